@@ -0,0 +1,108 @@
+#include "arena.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MAX_FREE 64           /* chunks kept parked beyond this are freed */
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+static pthread_mutex_t ar_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_chunk *ar_free;
+static struct arena_stats ar_stats;
+
+static struct arena_chunk *chunk_new(size_t size){
+    struct arena_chunk *c = NULL;
+    pthread_mutex_lock(&ar_mu);
+    if (size == ARENA_CHUNK_SIZE && ar_free) {
+        c = ar_free;
+        ar_free = c->next;
+        ar_stats.chunks_free--;
+    }
+    pthread_mutex_unlock(&ar_mu);
+    if (!c) {
+        c = malloc(sizeof(*c) + size);
+        if (!c) {
+            fprintf(stderr, "arena: out of memory\n");
+            abort();
+        }
+        pthread_mutex_lock(&ar_mu);
+        if (size == ARENA_CHUNK_SIZE) ar_stats.chunks++;
+        else ar_stats.large++;
+        pthread_mutex_unlock(&ar_mu);
+    }
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+void *arena_alloc(struct arena *a, size_t n){
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_chunk *c = a->head;
+    if (!c || c->size - c->used < n) {
+        /* Oversized requests get a chunk of their own. */
+        c = chunk_new(n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE);
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    a->used += n;
+    return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s){
+    size_t n = strlen(s) + 1;
+    return memcpy(arena_alloc(a, n), s, n);
+}
+
+/* Caller holds ar_mu. */
+static void release_until(struct arena *a, struct arena_chunk *keep){
+    while (a->head != keep) {
+        struct arena_chunk *c = a->head;
+        a->head = c->next;
+        if (c->size == ARENA_CHUNK_SIZE && ar_stats.chunks_free < ARENA_MAX_FREE) {
+            c->next = ar_free;
+            ar_free = c;
+            ar_stats.chunks_free++;
+        } else {
+            if (c->size == ARENA_CHUNK_SIZE) ar_stats.chunks--;
+            else ar_stats.large--;
+            free(c);
+        }
+    }
+}
+
+void arena_reset(struct arena *a){
+    pthread_mutex_lock(&ar_mu);
+    if (a->used > ar_stats.peak_request) ar_stats.peak_request = a->used;
+    release_until(a, NULL);
+    a->used = 0;
+    pthread_mutex_unlock(&ar_mu);
+}
+
+struct arena_mark arena_save(const struct arena *a){
+    struct arena_mark m = { a->head, a->head ? a->head->used : 0, a->used };
+    return m;
+}
+
+void arena_restore(struct arena *a, struct arena_mark m){
+    pthread_mutex_lock(&ar_mu);
+    if (a->used > ar_stats.peak_request) ar_stats.peak_request = a->used;
+    release_until(a, m.head);
+    pthread_mutex_unlock(&ar_mu);
+    if (a->head) a->head->used = m.head_used;
+    a->used = m.used;
+}
+
+void arena_get_stats(struct arena_stats *out){
+    pthread_mutex_lock(&ar_mu);
+    *out = ar_stats;
+    pthread_mutex_unlock(&ar_mu);
+}
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Bump allocator for per-request scratch memory. An arena owns nothing
+   between requests: arena_reset hands its chunks back to a process-wide
+   free list, so an idle session costs only the struct itself. Allocation
+   failure aborts; callers do not check for NULL. */
+#define ARENA_CHUNK_SIZE (32 * 1024)
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *head;
+    size_t used;                    /* bytes handed out since the last reset */
+};
+
+void *arena_alloc(struct arena *a, size_t n);
+char *arena_strdup(struct arena *a, const char *s);
+void  arena_reset(struct arena *a);
+
+/* Rewinds to a saved point, for loops that would otherwise grow one
+   request's arena per iteration. */
+struct arena_mark {
+    struct arena_chunk *head;
+    size_t head_used, used;
+};
+struct arena_mark arena_save(const struct arena *a);
+void  arena_restore(struct arena *a, struct arena_mark m);
+
+struct arena_stats {
+    unsigned long chunks;           /* standard chunks alive, in use or parked */
+    unsigned long chunks_free;      /* of those, parked on the free list */
+    unsigned long large;            /* oversized chunks currently live */
+    size_t peak_request;            /* most bytes one request ever used */
+};
+void arena_get_stats(struct arena_stats *out);
+#ifdef __cplusplus
+}
+#endif
+#endif
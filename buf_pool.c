@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include "buf_pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+static pthread_mutex_t bp_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bp_cv = PTHREAD_COND_INITIALIZER;
+static void **bp_free;
+static int bp_nfree, bp_count;
+static size_t bp_size;
+static int bp_peak;
+static unsigned long long bp_gets, bp_waits;
+
+int buf_pool_init(size_t bufsize, int count){
+    if (count < 1 || bufsize < BUF_POOL_ALIGN || bufsize % BUF_POOL_ALIGN) return -1;
+    bp_free = calloc((size_t)count, sizeof(*bp_free));
+    if (!bp_free) return -1;
+    for (int i = 0; i < count; i++) {
+        if (posix_memalign(&bp_free[i], BUF_POOL_ALIGN, bufsize) != 0) {
+            while (i--) free(bp_free[i]);
+            free(bp_free);
+            bp_free = NULL;
+            return -1;
+        }
+    }
+    bp_nfree = bp_count = count;
+    bp_size = bufsize;
+    return 0;
+}
+
+void *buf_pool_get(void){
+    pthread_mutex_lock(&bp_mu);
+    bp_gets++;
+    if (bp_nfree == 0) bp_waits++;
+    while (bp_nfree == 0) pthread_cond_wait(&bp_cv, &bp_mu);
+    void *b = bp_free[--bp_nfree];
+    if (bp_count - bp_nfree > bp_peak) bp_peak = bp_count - bp_nfree;
+    pthread_mutex_unlock(&bp_mu);
+    return b;
+}
+
+void buf_pool_put(void *buf){
+    if (!buf) return;
+    pthread_mutex_lock(&bp_mu);
+    bp_free[bp_nfree++] = buf;
+    pthread_cond_signal(&bp_cv);
+    pthread_mutex_unlock(&bp_mu);
+}
+
+size_t buf_pool_bufsize(void){
+    return bp_size;
+}
+
+void buf_pool_get_stats(struct buf_pool_stats *out){
+    pthread_mutex_lock(&bp_mu);
+    out->count = bp_count;
+    out->in_use = bp_count - bp_nfree;
+    out->peak = bp_peak;
+    out->gets = bp_gets;
+    out->waits = bp_waits;
+    pthread_mutex_unlock(&bp_mu);
+}
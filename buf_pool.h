@@ -0,0 +1,25 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Fixed set of page-aligned I/O buffers shared by all transfers in the
+   process. buf_pool_get blocks while every buffer is out, which is what
+   pushes back on a sender that outruns the disk. */
+#define BUF_POOL_ALIGN 4096
+
+int    buf_pool_init(size_t bufsize, int count);
+void  *buf_pool_get(void);
+void   buf_pool_put(void *buf);
+size_t buf_pool_bufsize(void);
+
+struct buf_pool_stats {
+    int count, in_use, peak;        /* peak: most buffers out at once */
+    unsigned long long gets, waits; /* waits: gets that found the pool empty */
+};
+void   buf_pool_get_stats(struct buf_pool_stats *out);
+#ifdef __cplusplus
+}
+#endif
+#endif
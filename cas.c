@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "cas.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+#define CAS_SWEEP_INTERVAL 3600
+
+static char cas_dir[PATH_MAX];
+static struct cas_stats *cas_st;
+static struct cas_stats cas_local;      /* if the stats file cannot be mapped */
+
+static int obj_path(char *out, size_t n, const unsigned char hash[SHA256_LEN]){
+    char hex[SHA256_LEN * 2 + 1];
+    sha256_hex(hash, hex);
+    int len = snprintf(out, n, "%s/%.2s/%s", cas_dir, hex, hex);
+    return len > 0 && (size_t)len < n ? 0 : -1;
+}
+
+/* A fresh name next to path, for building an entry before renaming it in. */
+static void tmp_path(char *out, size_t n, const char *path){
+    static unsigned seq;
+    const char *slash = strrchr(path, '/');
+    int dl = slash ? (int)(slash - path) : 0;
+    snprintf(out, n, "%.*s/.cas-%d-%u", dl, path, (int)getpid(), __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+}
+
+/* Makes tmp share src's data. A hard link first: its link count is what
+   tells the sweep an object is still in use. A reflink only when the
+   inode cannot take another link. */
+static int link_or_clone(const char *src, const char *tmp){
+    if (link(src, tmp) == 0) return 0;
+#ifdef FICLONE
+    if (errno != EMLINK) return -1;
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    int ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0) close(out);
+    close(in);
+    if (ok) return 0;
+    if (out >= 0) unlink(tmp);
+#endif
+    return -1;
+}
+
+/* Objects no file in the jail links to any more. Racing a placement is
+   harmless: the placed file keeps its own link to the data. */
+static void sweep(void){
+    for (int i = 0; i < 256; i++) {
+        char shard[PATH_MAX + 8], obj[PATH_MAX * 2];
+        snprintf(shard, sizeof(shard), "%s/%02x", cas_dir, i);
+        DIR *d = opendir(shard);
+        if (!d) continue;
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            struct stat st;
+            if (strlen(e->d_name) != SHA256_LEN * 2) continue;
+            snprintf(obj, sizeof(obj), "%s/%s", shard, e->d_name);
+            if (lstat(obj, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(obj) == 0)
+                __atomic_add_fetch(&cas_st->swept, 1, __ATOMIC_RELAXED);
+        }
+        closedir(d);
+    }
+}
+
+static void *sweep_thread(void *arg){
+    (void)arg;
+    for (;;) {
+        sweep();
+        sleep(CAS_SWEEP_INTERVAL);
+    }
+    return NULL;
+}
+
+int cas_open(const char *dir){
+    if (strlen(dir) >= sizeof(cas_dir) - 80) return -1;
+    strcpy(cas_dir, dir);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+    char sp[PATH_MAX];
+    snprintf(sp, sizeof(sp), "%s/stats", dir);
+    cas_st = &cas_local;
+    int fd = open(sp, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (st.st_size == sizeof(*cas_st) ||
+        (st.st_size == 0 && ftruncate(fd, sizeof(*cas_st)) == 0))) {
+        void *p = mmap(NULL, sizeof(*cas_st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) cas_st = p;
+    }
+    close(fd);
+    pthread_t t;
+    if (pthread_create(&t, NULL, sweep_thread, NULL) == 0) pthread_detach(t);
+    return 0;
+}
+
+int cas_place(const unsigned char hash[SHA256_LEN], uint64_t size, const char *dst){
+    if (!*cas_dir || size < CAS_MIN_SIZE) return -1;
+    char obj[PATH_MAX], tmp[PATH_MAX];
+    struct stat st;
+    if (obj_path(obj, sizeof(obj), hash) != 0 ||
+        lstat(obj, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != size) return -1;
+    struct stat cur;
+    /* Renaming a link over another link of the same inode does nothing. */
+    int same = lstat(dst, &cur) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev;
+    if (!same) {
+        tmp_path(tmp, sizeof(tmp), dst);
+        if (link_or_clone(obj, tmp) != 0) return -1;
+    }
+    /* The name only says what the object held when it was stored. Hash
+       the data it is about to be placed with; an object that no longer
+       matches leaves the store, and the client sends the file instead. */
+    unsigned char got[SHA256_LEN];
+    if (sha256_file(same ? dst : tmp, got) != 0 || memcmp(got, hash, SHA256_LEN) != 0) {
+        if (!same) unlink(tmp);
+        if (lstat(obj, &cur) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev) unlink(obj);
+        return -1;
+    }
+    if (!same && rename(tmp, dst) != 0) { unlink(tmp); return -1; }
+    __atomic_add_fetch(&cas_st->hits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cas_st->bytes_saved, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void cas_add(const unsigned char hash[SHA256_LEN], const char *src){
+    if (!*cas_dir) return;
+    char obj[PATH_MAX], tmp[PATH_MAX];
+    struct stat st;
+    if (obj_path(obj, sizeof(obj), hash) != 0) return;
+    if (lstat(src, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < CAS_MIN_SIZE) return;
+    if (lstat(obj, &st) == 0) return;
+    /* The shard directory is obj's parent. */
+    char *slash = strrchr(obj, '/');
+    *slash = '\0';
+    if (mkdir(obj, 0700) != 0 && errno != EEXIST) return;
+    *slash = '/';
+    tmp_path(tmp, sizeof(tmp), obj);
+    if (link_or_clone(src, tmp) != 0) return;
+    /* Another worker storing the same content concurrently is harmless:
+       both objects are identical and one rename wins. */
+    if (rename(tmp, obj) != 0) { unlink(tmp); return; }
+    __atomic_add_fetch(&cas_st->objects, 1, __ATOMIC_RELAXED);
+}
+
+void cas_count_miss(void){
+    if (cas_st) __atomic_add_fetch(&cas_st->misses, 1, __ATOMIC_RELAXED);
+}
+
+void cas_get_stats(struct cas_stats *out){
+    if (!cas_st) { memset(out, 0, sizeof(*out)); return; }
+    out->hits = __atomic_load_n(&cas_st->hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&cas_st->misses, __ATOMIC_RELAXED);
+    out->bytes_saved = __atomic_load_n(&cas_st->bytes_saved, __ATOMIC_RELAXED);
+    out->objects = __atomic_load_n(&cas_st->objects, __ATOMIC_RELAXED);
+    out->swept = __atomic_load_n(&cas_st->swept, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,35 @@
+#ifndef CAS_H
+#define CAS_H
+#include <stdint.h>
+#include "sha256.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Smaller files are neither stored nor looked up: a round trip and an
+   inode per object cost more than sending them again. */
+#define CAS_MIN_SIZE 65536
+
+struct cas_stats {
+    unsigned long long hits, misses;
+    unsigned long long bytes_saved;     /* payload not sent thanks to hits */
+    unsigned long long objects;         /* objects added */
+    unsigned long long swept;           /* objects removed once unreferenced */
+};
+
+/* Content-addressed store of uploaded files, dir/<2 hex>/<64 hex>. Objects
+   are hard links to the files they came from (reflinks if the link count
+   is exhausted), so callers must never modify a file with more than one
+   link in place. cas_place re-hashes an object before placing it anyway
+   and drops one whose data no longer matches its name. An hourly sweep
+   drops objects nothing else links to.
+   Counters live in dir/stats and are shared by every process that opens
+   the store. */
+int  cas_open(const char *dir);
+int  cas_place(const unsigned char hash[SHA256_LEN], uint64_t size, const char *dst);
+void cas_add(const unsigned char hash[SHA256_LEN], const char *src);
+void cas_count_miss(void);
+void cas_get_stats(struct cas_stats *out);
+#ifdef __cplusplus
+}
+#endif
+#endif
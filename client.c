@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include "delete_directory.h"
+#include "copy_tree.h"
+#include "sha256.h"
+#include "cas.h"
 #include <dirent.h>
 #include <sys/stat.h>
 #include <stdio.h>
@@ -7,18 +11,25 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <signal.h>
 
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 #define BUF_SIZE 1024
+/* An upload whose file changed while it was sent: fewer bytes than
+   announced are left, and the only way to stop the server from
+   committing the file is to close the connection. */
+#define UPLOAD_BROKEN (-2)
 #ifdef _WIN32
   #define CLOSESOCK closesocket
   #include <winsock2.h>
   #include <ws2tcpip.h>
   #include <windows.h>
   static void sleep_seconds(unsigned sec) { Sleep(sec * 1000); }
+  static double now_seconds(void) { return (double)GetTickCount64() / 1000.0; }
+  static int cpu_count(void) { SYSTEM_INFO si; GetSystemInfo(&si); return (int)si.dwNumberOfProcessors; }
   static void log_sock_err(const char* msg) { fprintf(stderr, "%s (WSAGetLastError=%ld)\n", msg, (long)WSAGetLastError()); }
   #ifndef strncasecmp
   #define strncasecmp _strnicmp
@@ -28,7 +39,10 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
   #define CLOSESOCK close
+#include <time.h>
   static void sleep_seconds(unsigned sec) { sleep(sec); }
+  static double now_seconds(void) { struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts); return ts.tv_sec + ts.tv_nsec / 1e9; }
+  static int cpu_count(void) { long n = sysconf(_SC_NPROCESSORS_ONLN); return n > 0 ? (int)n : 1; }
   static void log_sock_err(const char* msg) { perror(msg); }
 #endif
 
@@ -38,23 +52,198 @@ static int send_all(int s, const void *b, size_t n){
     return 0;
 }
 
+static int recv_line(int s, char *buf, size_t bufsz){
+    size_t u = 0;
+    while (u + 1 < bufsz) {
+        char ch; int r = recv(s, &ch, 1, 0);
+        if (r <= 0) return -1;
+        if (ch == '\n') break;
+        if (ch != '\r') buf[u++] = ch;
+    }
+    buf[u] = '\0';
+    return (int)u;
+}
+
+/* Offers the content hash before any data. Returns 0 if the server
+   already holds the content (its usual reply follows), 1 if the data
+   must be sent after all, -1 on error. */
+static int send_hash_first(int sock, const char *srcpath, long long fsz){
+    unsigned char h[SHA256_LEN];
+    char hex[SHA256_LEN * 2 + 1], line[128];
+    if (sha256_file(srcpath, h) != 0) return 1;
+    sha256_hex(h, hex);
+    int m = snprintf(line, sizeof(line), "HASH %lld %s\n", fsz, hex);
+    if (send_all(sock, line, (size_t)m) < 0 || recv_line(sock, line, sizeof(line)) < 0) return -1;
+    if (!strcmp(line, "SEND")) return 1;
+    if (!strcmp(line, "HAVE")) {
+        printf("Dedup: server already has these %lld bytes\n", fsz);
+        return 0;
+    }
+    printf("Server: %s\n", line);
+    return -1;
+}
+
+#if defined(SEEK_DATA) && !defined(_WIN32)
+/* Matches the server's limit; past it neighbouring extents are merged,
+   sending the smallest holes as zeros. */
+#define SPARSE_MAX_EXTENTS 65536
+#define SPARSE_BUF_SIZE (1 << 20)
+
+struct extent { long long off, len; };
+
+/* Data extents of fd per SEEK_DATA/SEEK_HOLE, or NULL if the filesystem
+   cannot tell. */
+static struct extent *data_extents(int fd, long long size, size_t *count){
+    struct extent *v = NULL;
+    size_t n = 0, cap = 0;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t d = lseek(fd, pos, SEEK_DATA);
+        if (d < 0 && errno == ENXIO) break;
+        off_t h = d < 0 ? -1 : lseek(fd, d, SEEK_HOLE);
+        if (h < 0) { free(v); return NULL; }
+        if (h > size) h = size;
+        if (n == cap) {
+            size_t ncap = cap ? cap * 2 : 64;
+            struct extent *nv = realloc(v, ncap * sizeof(*nv));
+            if (!nv) { free(v); return NULL; }
+            v = nv; cap = ncap;
+        }
+        v[n].off = d;
+        v[n].len = h - d;
+        n++;
+        pos = h;
+    }
+    long long gap = 4096;
+    while (n > SPARSE_MAX_EXTENTS) {
+        size_t m = 0;
+        for (size_t i = 1; i < n; i++) {
+            if (v[i].off - (v[m].off + v[m].len) < gap) v[m].len = v[i].off + v[i].len - v[m].off;
+            else v[++m] = v[i];
+        }
+        n = m + 1;
+        gap *= 2;
+    }
+    *count = n;
+    return v ? v : malloc(1);
+}
+
+/* "SPARSE <size> <n>", the extent table, then only the data. Returns 1
+   when the file has no holes worth skipping, for the plain path, and
+   UPLOAD_BROKEN if an extent cannot be read in full any more. */
+static int send_sparse(FILE *fp, int sock, long long fsz){
+    int fd = fileno(fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (long long)st.st_blocks * 512 >= fsz) return 1;
+    size_t n = 0;
+    struct extent *v = data_extents(fd, fsz, &n);
+    if (!v) return 1;
+    char *buf = malloc(SPARSE_BUF_SIZE);
+    int rc = buf ? 0 : -1;
+    size_t used = 0;
+    if (rc == 0) used = (size_t)snprintf(buf, SPARSE_BUF_SIZE, "SPARSE %lld %lu\n", fsz, (unsigned long)n);
+    long long data = 0;
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        if (SPARSE_BUF_SIZE - used < 64) { rc = send_all(sock, buf, used); used = 0; }
+        used += (size_t)snprintf(buf + used, SPARSE_BUF_SIZE - used, "%lld %lld\n", v[i].off, v[i].len);
+        data += v[i].len;
+    }
+    if (rc == 0 && used) rc = send_all(sock, buf, used);
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        for (long long done = 0; rc == 0 && done < v[i].len; ) {
+            size_t want = v[i].len - done > SPARSE_BUF_SIZE ? SPARSE_BUF_SIZE : (size_t)(v[i].len - done);
+            ssize_t r = pread(fd, buf, want, (off_t)(v[i].off + done));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { rc = UPLOAD_BROKEN; break; }     /* the file shrank */
+            rc = send_all(sock, buf, (size_t)r);
+            done += r;
+        }
+    }
+    if (rc == 0) printf("Sparse upload: %lld of %lld bytes sent (%lu extents)\n", data, fsz, (unsigned long)n);
+    free(buf);
+    free(v);
+    return rc;
+}
+#endif
+
+/* Returns 0 once the body is out, -1 on a send error, UPLOAD_BROKEN if
+   the file no longer holds the bytes announced. */
 static int send_file_with_size(FILE *fp, int sock, const char *srcpath){
     long long fsz = 0;
+    int holes = 0;
 #ifdef _WIN32
     struct _stati64 st; if (_stati64(srcpath, &st)!=0) return -1; fsz = (long long)st.st_size;
 #else
     struct stat st; if (stat(srcpath, &st)!=0) return -1; fsz = (long long)st.st_size;
+    holes = (long long)st.st_blocks * 512 < fsz;
+#endif
+    /* Sparse uploads are neither hashed nor stored by the server, and
+       hashing would read every hole: a mostly empty image goes straight
+       to the extent path. */
+    if (fsz >= CAS_MIN_SIZE && !holes) {
+        int d = send_hash_first(sock, srcpath, fsz);
+        if (d != 1) return d;
+    }
+#if defined(SEEK_DATA) && !defined(_WIN32)
+    int sp = send_sparse(fp, sock, fsz);
+    if (sp != 1) return sp;
 #endif
     char hdr[64]; int m = snprintf(hdr, sizeof(hdr), "SIZE %lld\n", fsz);
     if (m<=0 || send_all(sock, hdr, (size_t)m)<0) return -1;
 
-    char buf[BUF_SIZE]; size_t r;
-    while((r=fread(buf,1,sizeof(buf),fp))>0){
-        if(send_all(sock, buf, r)<0) return -1;
+    /* Exactly fsz bytes: a file that grew is cut at the announced size
+       (a HASH offered for it then fails on the server), one that shrank
+       cannot be completed. */
+    char buf[BUF_SIZE];
+    for (long long left = fsz; left > 0; ) {
+        size_t want = left > (long long)sizeof(buf) ? sizeof(buf) : (size_t)left;
+        size_t r = fread(buf, 1, want, fp);
+        if (r < want) return UPLOAD_BROKEN;
+        if (send_all(sock, buf, r) < 0) return -1;
+        left -= (long long)r;
     }
     return 0;
 }
 
+/* Connection a Ctrl-C cancels the running command on; -1 when none. */
+static volatile sig_atomic_t cancel_sock = -1;
+
+/* send() is safe in a handler. The server stops the walk at the next
+   check and still ends the reply with its END line, which is read as
+   usual; one scancel is enough. */
+static void on_cancel(int sig){
+    (void)sig;
+    int s = cancel_sock;
+    if (s < 0) return;
+    cancel_sock = -1;
+    send(s, "scancel\n", 8, 0);
+}
+
+/* For commands whose reply is streamed line by line and closed by an
+   "END" line (sfind, sstat). With cancellable set, Ctrl-C sends scancel
+   instead of ending the client. */
+static int recv_until_end(int s, int cancellable){
+    char line[PATH_MAX * 2];
+    int rc = 0;
+    if (cancellable) {
+        cancel_sock = s;
+        signal(SIGINT, on_cancel);
+    }
+    for (;;) {
+        if (recv_line(s, line, sizeof(line)) < 0) { rc = -1; break; }
+        if (!strncmp(line, "END", 3) && (line[3] == ' ' || line[3] == '\0')) {
+            printf("Server: %s\n", line);
+            break;
+        }
+        puts(line);
+    }
+    if (cancellable) {
+        cancel_sock = -1;
+        signal(SIGINT, SIG_DFL);
+    }
+    return rc;
+}
+
 static const char* path_basename(const char* p){
     const char *b = p, *s;
     for (s = p; *s; ++s) if (*s=='/' || *s=='\\') b = s+1;
@@ -105,15 +294,203 @@ static void local_rm(const char *path){
     if (!strcmp(path,"/")){ fprintf(stderr,"rm: refusing to delete '/'\n"); return; }
     if (delete_directory(path)!=0) fprintf(stderr,"rm: failed\n");
 }
-static int local_copy_file(const char *src, const char *dst){
-    FILE *in=fopen(src,"rb"); if(!in){perror("open src"); return -1;}
-    FILE *out=fopen(dst,"wb"); if(!out){perror("open dst"); fclose(in); return -1;}
-    char buf[BUF_SIZE]; size_t r;
-    while((r=fread(buf,1,sizeof(buf),in))>0){
-        if(fwrite(buf,1,r,out)!=r){perror("write dst"); fclose(in); fclose(out); return -1;}
+static int local_copy(const char *src, const char *dst){
+    struct copy_opts o = {0};
+    o.workers = cpu_count();
+    double t0 = now_seconds();
+    if (copy_tree_ex(src, dst, &o) != 0) { perror("copy"); return -1; }
+    double dt = now_seconds() - t0;
+    double mb = (double)o.bytes / (1024.0 * 1024.0);
+    printf("Copied %llu file(s), %.1f MB in %.2f s (%.1f MB/s)\n",
+           o.files, mb, dt, dt > 0 ? mb / dt : 0.0);
+    return 0;
+}
+/* ---- sync: mirror a local tree to the server's cwd ---- */
+struct sync_file { char *rel; long long size; };
+struct sync_files { struct sync_file *v; size_t n, cap; };
+
+static int collect_local(const char *root, const char *rel, struct sync_files *l){
+    char dir[PATH_MAX];
+    if (*rel) join_path(dir, sizeof(dir), root, rel);
+    else { strncpy(dir, root, sizeof(dir)-1); dir[sizeof(dir)-1] = '\0'; }
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *e;
+    int ret = 0;
+    while (ret == 0 && (e = readdir(d))) {
+        if (!strcmp(e->d_name,".") || !strcmp(e->d_name,"..")) continue;
+        char crel[PATH_MAX], full[PATH_MAX];
+        snprintf(crel, sizeof(crel), "%s%s%s", rel, *rel ? "/" : "", e->d_name);
+        join_path(full, sizeof(full), root, crel);
+        struct stat st;
+        if (stat(full, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) { ret = collect_local(root, crel, l); continue; }
+        if (!S_ISREG(st.st_mode)) continue;
+        if (l->n == l->cap) {
+            size_t ncap = l->cap ? l->cap * 2 : 256;
+            struct sync_file *nv = realloc(l->v, ncap * sizeof(*nv));
+            if (!nv) { ret = -1; break; }
+            l->v = nv; l->cap = ncap;
+        }
+        if (!(l->v[l->n].rel = strdup(crel))) { ret = -1; break; }
+        l->v[l->n++].size = (long long)st.st_size;
     }
-    fclose(in); fclose(out); return 0;
+    closedir(d);
+    return ret;
 }
+
+static int find_sync_file(const struct sync_files *l, const char *rel){
+    for (size_t i = 0; i < l->n; i++) if (!strcmp(l->v[i].rel, rel)) return (int)i;
+    return -1;
+}
+
+/* smkdir every component of rel's parent; existing ones just fail. */
+static void remote_mkdirs(int sock, const char *rel){
+    char part[PATH_MAX], resp[256];
+    const char *s = rel, *slash;
+    while ((slash = strchr(s, '/'))) {
+        size_t n = (size_t)(slash - rel);
+        if (n >= sizeof(part)) return;
+        memcpy(part, rel, n); part[n] = '\0';
+        int m = snprintf(resp, sizeof(resp), "smkdir %s\n", part);
+        if (m <= 0 || m >= (int)sizeof(resp) || send_all(sock, resp, (size_t)m) < 0) return;
+        if (recv_line(sock, resp, sizeof(resp)) < 0) return;
+        s = slash + 1;
+    }
+}
+
+/* 0 on success, -1 on failure, UPLOAD_BROKEN if the connection must be
+   dropped. */
+static int upload_file(int sock, const char *local, const char *remote){
+    FILE *fp = fopen(local, "rb");
+    if (!fp) return -1;
+    char resp[256];
+    int rc = send_all(sock, "write_file\n", 11) == 0 &&
+             send_all(sock, remote, strlen(remote)) == 0 && send_all(sock, "\n", 1) == 0 ? 0 : -1;
+    if (rc == 0) rc = send_file_with_size(fp, sock, local);
+    fclose(fp);
+    if (rc != 0) return rc;
+    return recv_line(sock, resp, sizeof(resp)) >= 0 && !strcmp(resp, "OK") ? 0 : -1;
+}
+
+/* sync <localdir> [remotedir]: sends a manifest of the local tree, then
+   uploads only what ssync reports as different and removes what the
+   server has but the local tree does not. Returns UPLOAD_BROKEN if a
+   file changed mid-upload and the connection must be dropped. */
+static int sync_tree(int sock, const char *localdir, const char *remotedir){
+    char line[PATH_MAX + 128], full[PATH_MAX], hex[SHA256_LEN * 2 + 1];
+    struct sync_files l = {0};
+    if (remotedir && *remotedir) {
+        int m = snprintf(line, sizeof(line), "scd %s\n", remotedir);
+        if (m <= 0 || m >= (int)sizeof(line) || send_all(sock, line, (size_t)m) < 0 ||
+            recv_line(sock, line, sizeof(line)) < 0 || strcmp(line, "Directory changed") != 0) {
+            printf("sync: cannot enter remote directory\n");
+            return 0;
+        }
+    }
+    if (collect_local(localdir, "", &l) != 0) { perror("sync: scan"); goto out; }
+
+    double t0 = now_seconds();
+    int m = snprintf(line, sizeof(line), "ssync %lu\n", (unsigned long)l.n);
+    if (send_all(sock, line, (size_t)m) < 0) { perror("send"); goto out; }
+    for (size_t i = 0; i < l.n; i++) {
+        unsigned char h[SHA256_LEN];
+        join_path(full, sizeof(full), localdir, l.v[i].rel);
+        if (sha256_file(full, h) != 0) memset(h, 0, sizeof(h));   /* forces a resend */
+        sha256_hex(h, hex);
+        m = snprintf(line, sizeof(line), "%lld %s %s\n", l.v[i].size, hex, l.v[i].rel);
+        if (m <= 0 || m >= (int)sizeof(line) || send_all(sock, line, (size_t)m) < 0) { perror("send"); goto out; }
+    }
+
+    /* Collect the whole reply first: the transfers reuse the socket. */
+    struct sync_files sends = {0}, dels = {0};
+    for (;;) {
+        if (recv_line(sock, line, sizeof(line)) < 0) { printf("Server disconnected\n"); break; }
+        if (!strncmp(line, "END", 3)) break;
+        struct sync_files *dst = !strncmp(line, "SEND ", 5) ? &sends : !strncmp(line, "DELETE ", 7) ? &dels : NULL;
+        if (!dst) { printf("Server: %s\n", line); break; }
+        if (dst->n == dst->cap) {
+            size_t ncap = dst->cap ? dst->cap * 2 : 64;
+            struct sync_file *nv = realloc(dst->v, ncap * sizeof(*nv));
+            if (!nv) break;
+            dst->v = nv; dst->cap = ncap;
+        }
+        dst->v[dst->n].size = 0;
+        if ((dst->v[dst->n].rel = strdup(line + (dst == &sends ? 5 : 7)))) dst->n++;
+    }
+
+    unsigned long deleted = 0, sent = 0, failed = 0;
+    unsigned long long bytes = 0;
+    int broken = 0;
+    for (size_t i = 0; i < dels.n; i++) {
+        m = snprintf(line, sizeof(line), "srm %s\n", dels.v[i].rel);
+        if (m > 0 && m < (int)sizeof(line) && send_all(sock, line, (size_t)m) == 0 &&
+            recv_line(sock, line, sizeof(line)) >= 0 && !strcmp(line, "Deleted")) deleted++;
+        else failed++;
+    }
+    for (size_t i = 0; i < sends.n && !broken; i++) {
+        remote_mkdirs(sock, sends.v[i].rel);
+        join_path(full, sizeof(full), localdir, sends.v[i].rel);
+        int rc = upload_file(sock, full, sends.v[i].rel);
+        if (rc == 0) {
+            int k = find_sync_file(&l, sends.v[i].rel);
+            if (k >= 0) bytes += (unsigned long long)l.v[k].size;
+            sent++;
+        } else {
+            failed++;
+            if (rc == UPLOAD_BROKEN) {
+                printf("sync: %s changed while it was sent; stopping\n", sends.v[i].rel);
+                broken = 1;
+            }
+        }
+    }
+    double dt = now_seconds() - t0;
+    printf("sync: %lu file(s) up to date, %lu sent (%.1f MB), %lu deleted, %lu failed in %.2f s\n",
+           (unsigned long)(l.n - sends.n), sent, (double)bytes / (1024.0 * 1024.0), deleted, failed, dt);
+    for (size_t i = 0; i < sends.n; i++) free(sends.v[i].rel);
+    for (size_t i = 0; i < dels.n; i++) free(dels.v[i].rel);
+    free(sends.v); free(dels.v);
+    for (size_t i = 0; i < l.n; i++) free(l.v[i].rel);
+    free(l.v);
+    return broken ? UPLOAD_BROKEN : 0;
+out:
+    for (size_t i = 0; i < l.n; i++) free(l.v[i].rel);
+    free(l.v);
+    return 0;
+}
+
+/* sbatch <file> [stop]: sends every non-empty line of a local script of
+   smkdir/srm/srename/scopy commands as one batch and prints the single
+   result line. */
+static void batch_from_file(int sock, const char *path, int stop){
+    FILE *fp = fopen(path, "r");
+    if (!fp) { perror("sbatch"); return; }
+    char line[PATH_MAX * 2 + 16];
+    size_t n = 0, cap = 0, len = 0;
+    char *body = NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!*line) continue;
+        size_t l = strlen(line);
+        if (len + l + 2 > cap) {
+            size_t ncap = cap ? cap * 2 : 4096;
+            while (ncap < len + l + 2) ncap *= 2;
+            char *nb = realloc(body, ncap);
+            if (!nb) { perror("sbatch"); fclose(fp); free(body); return; }
+            body = nb; cap = ncap;
+        }
+        memcpy(body + len, line, l);
+        body[len + l] = '\n';
+        len += l + 1;
+        n++;
+    }
+    fclose(fp);
+    int m = snprintf(line, sizeof(line), "sbatch %lu%s\n", (unsigned long)n, stop ? " stop" : "");
+    if (send_all(sock, line, (size_t)m) < 0 || (len && send_all(sock, body, len) < 0)) perror("send");
+    else if (recv_line(sock, line, sizeof(line)) >= 0) printf("Server: %s\n", line);
+    free(body);
+}
+
 static void send_file_chunks(FILE *fp, int sockfd) {
     char data[BUF_SIZE];
     size_t n;
@@ -124,6 +501,26 @@ static void send_file_chunks(FILE *fp, int sockfd) {
     if (send(sockfd, "EOF", 3, 0) < 0) perror("send EOF");
 }
 
+static int connect_server(const struct sockaddr_in *server){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+    if (connect(sock, (const struct sockaddr *)server, sizeof(*server)) < 0) {
+        CLOSESOCK(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Drops a connection left in the middle of an upload, so the server
+   discards it, and starts a new session (back at the jail root). */
+static int reconnect(int sock, const struct sockaddr_in *server){
+    CLOSESOCK(sock);
+    sock = connect_server(server);
+    if (sock < 0) perror("reconnect failed");
+    else printf("Upload abandoned; reconnected (server directory is / again).\n");
+    return sock;
+}
+
 int main() {
     int sock;
     struct sockaddr_in server;
@@ -133,20 +530,13 @@ int main() {
     WSADATA wsa; if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) { log_sock_err("WSAStartup failed"); return 1; }
 #endif
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) { printf("Socket creation failed\n"); 
-#ifdef _WIN32
-        WSACleanup();
-#endif
-        return 1; }
-
     server.sin_family = AF_INET;
     server.sin_port   = htons(5000);
     server.sin_addr.s_addr = inet_addr("192.168.0.172");
 
-    if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    sock = connect_server(&server);
+    if (sock < 0) {
         perror("connect failed");
-        CLOSESOCK(sock);
 #ifdef _WIN32
         WSACleanup();
 #endif
@@ -168,6 +558,20 @@ int main() {
         if (!strncmp(buffer, "mkdir ", 6)) { local_mkdir(buffer+6); continue; }
         if (!strncmp(buffer, "rm ", 3)) { local_rm(buffer+3); continue; }
 
+        if (!strncmp(buffer, "sync ", 5)) {
+            char local[PATH_MAX], remote[PATH_MAX] = "";
+            if (sscanf(buffer + 5, "%4095s %4095s", local, remote) < 1) { printf("usage: sync <localdir> [remotedir]\n"); continue; }
+            if (sync_tree(sock, local, remote) == UPLOAD_BROKEN && (sock = reconnect(sock, &server)) < 0) break;
+            continue;
+        }
+
+        if (!strncmp(buffer, "sbatch ", 7)) {
+            char path[PATH_MAX], opt[16] = "";
+            if (sscanf(buffer + 7, "%4095s %15s", path, opt) < 1) { printf("usage: sbatch <file> [stop]\n"); continue; }
+            batch_from_file(sock, path, !strcmp(opt, "stop"));
+            continue;
+        }
+
         if (!strncmp(buffer, "send_file", 9)) {
             char src[PATH_MAX], mode[16], dest[PATH_MAX];
 
@@ -197,7 +601,7 @@ int main() {
                 if (treat_as_dir) join_path(finaldst, sizeof(finaldst), dest, path_basename(src));
                 else { strncpy(finaldst, dest, sizeof(finaldst)-1); finaldst[sizeof(finaldst)-1] = '\0'; }
 
-                if (local_copy_file(src, finaldst) == 0) printf("Local copy OK: %s\n", finaldst);
+                if (local_copy(src, finaldst) == 0) printf("Local copy OK: %s\n", finaldst);
                 else printf("Local copy FAILED\n");
                 continue;
             }
@@ -211,10 +615,12 @@ int main() {
 
             if (dest[0] != '\0' && !(dest[0]=='.' && dest[1]=='\0')) {
                 char scd[PATH_MAX+8];
-                int m = snprintf(scd, sizeof(scd), "scd %s", dest);
-                if (m > 0) {
-                    if (send(sock, scd, (size_t)m, 0) < 0 || send(sock, "\n", 1, 0) < 0) { perror("send scd"); fclose(fp); continue; }
-                }
+                int m = snprintf(scd, sizeof(scd), "scd %s\n", dest);
+                if (m <= 0 || m >= (int)sizeof(scd) || send_all(sock, scd, (size_t)m) < 0) { perror("send scd"); fclose(fp); continue; }
+                /* The reply must be read before write_file, or it is taken
+                   for the answer to what follows. */
+                if (recv_line(sock, scd, sizeof(scd)) < 0) { printf("Server disconnected\n"); fclose(fp); break; }
+                if (strcmp(scd, "Directory changed") != 0) { printf("Server: %s\n", scd); fclose(fp); continue; }
             }
 
             if (send_all(sock, "write_file\n", 11) < 0) { perror("send write_file"); fclose(fp); continue; }
@@ -224,8 +630,14 @@ int main() {
             perror("send filename"); fclose(fp); continue;
             }
 
-            if (send_file_with_size(fp, sock, src) < 0) { perror("send file"); fclose(fp); continue; }
+            int rc = send_file_with_size(fp, sock, src);
             fclose(fp);
+            if (rc == UPLOAD_BROKEN) {
+                printf("%s changed while it was sent\n", src);
+                if ((sock = reconnect(sock, &server)) < 0) break;
+                continue;
+            }
+            if (rc < 0) { perror("send file"); continue; }
 
             char resp[256] = {0};
             int r = recv(sock, resp, sizeof(resp)-1, 0);
@@ -238,6 +650,11 @@ int main() {
             continue;
         }
 
+        if (!strcmp(buffer, "sfind") || !strncmp(buffer, "sfind ", 6) || !strcmp(buffer, "sstat")) {
+            if (recv_until_end(sock, buffer[1] == 'f') < 0) { printf("Server disconnected\n"); break; }
+            continue;
+        }
+
         char reply[BUF_SIZE] = {0};
         int n = recv(sock, reply, sizeof(reply)-1, 0);
         if (n > 0) {
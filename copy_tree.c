@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include "copy_tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+
+static int copy_entry(const char *src, const char *dst, struct copy_opts *o){
+    DWORD attrs = GetFileAttributesA(src);
+    if (attrs == INVALID_FILE_ATTRIBUTES) return -1;
+    if (!(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+        WIN32_FILE_ATTRIBUTE_DATA fa;
+        if (!CopyFileExA(src, dst, NULL, NULL, NULL, 0)) return -1;
+        if (GetFileAttributesExA(src, GetFileExInfoStandard, &fa))
+            o->bytes += ((unsigned long long)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+        o->files++;
+        return 0;
+    }
+    if (!CreateDirectoryA(dst, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) return -1;
+    WIN32_FIND_DATAA ffd;
+    char pattern[MAX_PATH], csrc[MAX_PATH], cdst[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", src);
+    HANDLE h = FindFirstFileA(pattern, &ffd);
+    if (h == INVALID_HANDLE_VALUE) return -1;
+    int ret = 0;
+    do {
+        if (!strcmp(ffd.cFileName, ".") || !strcmp(ffd.cFileName, "..")) continue;
+        snprintf(csrc, sizeof(csrc), "%s\\%s", src, ffd.cFileName);
+        snprintf(cdst, sizeof(cdst), "%s\\%s", dst, ffd.cFileName);
+        if (copy_entry(csrc, cdst, o) != 0) { ret = -1; break; }
+    } while (FindNextFileA(h, &ffd));
+    FindClose(h);
+    return ret;
+}
+
+int copy_tree_ex(const char *src, const char *dst, struct copy_opts *o){
+    if (!src || !*src || !dst || !*dst || !o) return -1;
+    o->files = o->bytes = 0;
+    return copy_entry(src, dst, o);
+}
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#define COPY_BUF_SIZE (1 << 20)
+#define COPY_QUEUE_MAX 1024
+/* Longest part of a basename kept in a temporary's name: "." and
+   ".XXXXXX" must still fit in NAME_MAX. */
+#define COPY_TMP_KEEP (NAME_MAX - 8)
+
+/* Copies [off, off+len) at the same offset in both files. Tries
+   copy_file_range first and falls back to pread/pwrite through a 1 MB
+   buffer for filesystems (or kernels) that cannot do it in-kernel. */
+static int copy_range(int in, int out, off_t off, off_t len){
+    off_t end = off + len;
+    while (off < end) {
+        loff_t io = off, oo = off;
+        ssize_t n = copy_file_range(in, &io, out, &oo, (size_t)(end - off), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                errno == EOPNOTSUPP || errno == EBADF) break;
+            return -1;
+        }
+        if (n == 0) return 0;
+        off += n;
+    }
+    if (off >= end) return 0;
+
+    char *buf = malloc(COPY_BUF_SIZE);
+    if (!buf) return -1;
+    while (off < end) {
+        size_t want = (end - off > COPY_BUF_SIZE) ? COPY_BUF_SIZE : (size_t)(end - off);
+        ssize_t r = pread(in, buf, want, off);
+        if (r < 0) { if (errno == EINTR) continue; free(buf); return -1; }
+        if (r == 0) break;
+        ssize_t w = 0;
+        while (w < r) {
+            ssize_t k = pwrite(out, buf + w, (size_t)(r - w), off + w);
+            if (k < 0) { if (errno == EINTR) continue; free(buf); return -1; }
+            w += k;
+        }
+        off += r;
+    }
+    free(buf);
+    return 0;
+}
+
+/* Reflink when the filesystem allows it; otherwise copy only the data
+   extents so holes in sparse files stay holes in the copy. */
+static int copy_data(int in, int out, off_t size, unsigned long long *copied){
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) { *copied = (unsigned long long)size; return 0; }
+#endif
+    *copied = 0;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(in, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;          /* only a hole remains */
+            data = pos;                         /* no SEEK_DATA: copy it all */
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0) hole = size;
+        if (copy_range(in, out, data, hole - data) != 0) return -1;
+        *copied += (unsigned long long)(hole - data);
+        pos = hole;
+    }
+    return ftruncate(out, size);
+}
+
+/* The data goes to a temporary file that is renamed over dst, so dst is
+   never truncated in place: it may be src itself, or share its inode
+   with other links. The temporary's name keeps at most COPY_TMP_KEEP
+   bytes of dst's; mkostemp makes it unique either way. */
+static int copy_file(const char *src, const char *dst, mode_t mode, unsigned long long *copied){
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    struct stat st;
+    if (fstat(in, &st) != 0) { close(in); return -1; }
+    char tmp[PATH_MAX + 16];
+    const char *slash = strrchr(dst, '/');
+    if (slash) snprintf(tmp, sizeof(tmp), "%.*s/.%.*s.XXXXXX", (int)(slash - dst), dst, COPY_TMP_KEEP, slash + 1);
+    else snprintf(tmp, sizeof(tmp), ".%.*s.XXXXXX", COPY_TMP_KEEP, dst);
+    int out = mkostemp(tmp, O_CLOEXEC);
+    if (out < 0) { close(in); return -1; }
+    int ret = fchmod(out, mode & 07777) == 0 ? copy_data(in, out, st.st_size, copied) : -1;
+    if (close(out) != 0) ret = -1;
+    close(in);
+    if (ret == 0 && rename(tmp, dst) != 0) ret = -1;
+    if (ret != 0) unlink(tmp);
+    return ret;
+}
+
+/* Whether a symlink created at dst with this target points inside jail,
+   judged on the text: dst's directory joined with target, "." and ".."
+   folded. */
+static int link_inside(const char *jail, const char *dst, const char *target){
+    char path[PATH_MAX * 2], out[PATH_MAX * 2];
+    const char *slash = strrchr(dst, '/');
+    if (target[0] == '/') snprintf(path, sizeof(path), "%s", target);
+    else if (dst[0] == '/' && slash) snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - dst), dst, target);
+    else return 0;
+    size_t len = 0;
+    for (const char *p = path; *p; ) {
+        size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            while (len > 0 && out[--len] != '/') ;
+        } else if (n > 0 && !(n == 1 && p[0] == '.')) {
+            out[len++] = '/';
+            memcpy(out + len, p, n);
+            len += n;
+        }
+        p += n;
+        if (*p) p++;
+    }
+    out[len] = '\0';
+    size_t jl = strlen(jail);
+    return strncmp(out, jail, jl) == 0 && (out[jl] == '/' || out[jl] == '\0');
+}
+
+/* Directories are walked by the calling thread; regular files become jobs
+   for the worker pool so that many small files copy in parallel. */
+struct copy_job {
+    struct copy_job *next;
+    mode_t mode;
+    char *src, *dst;
+};
+
+struct copy_ctx {
+    struct copy_opts *o;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    struct copy_job *head, *tail;
+    int queued, done, failed, pool;
+};
+
+static void ctx_account(struct copy_ctx *c, int rc, unsigned long long copied){
+    pthread_mutex_lock(&c->mu);
+    if (rc != 0) c->failed = 1;
+    else { c->o->files++; c->o->bytes += copied; }
+    pthread_mutex_unlock(&c->mu);
+}
+
+static void *copy_worker(void *arg){
+    struct copy_ctx *c = arg;
+    for (;;) {
+        pthread_mutex_lock(&c->mu);
+        while (!c->head && !c->done) pthread_cond_wait(&c->cv, &c->mu);
+        struct copy_job *j = c->head;
+        if (!j) { pthread_mutex_unlock(&c->mu); return NULL; }
+        c->head = j->next;
+        if (!c->head) c->tail = NULL;
+        c->queued--;
+        pthread_cond_broadcast(&c->cv);
+        int skip = c->failed;
+        pthread_mutex_unlock(&c->mu);
+
+        if (!skip) {
+            unsigned long long copied = 0;
+            int rc = copy_file(j->src, j->dst, j->mode, &copied);
+            ctx_account(c, rc, copied);
+        }
+        free(j->src); free(j->dst); free(j);
+    }
+}
+
+static int enqueue_file(struct copy_ctx *c, const char *src, const char *dst, mode_t mode){
+    if (!c->pool) {
+        unsigned long long copied = 0;
+        int rc = copy_file(src, dst, mode, &copied);
+        ctx_account(c, rc, copied);
+        return rc;
+    }
+    struct copy_job *j = calloc(1, sizeof(*j));
+    if (!j || !(j->src = strdup(src)) || !(j->dst = strdup(dst))) {
+        if (j) { free(j->src); free(j); }
+        return -1;
+    }
+    j->mode = mode;
+    pthread_mutex_lock(&c->mu);
+    while (c->queued >= COPY_QUEUE_MAX && !c->failed) pthread_cond_wait(&c->cv, &c->mu);
+    if (c->tail) c->tail->next = j; else c->head = j;
+    c->tail = j;
+    c->queued++;
+    int failed = c->failed;
+    pthread_cond_broadcast(&c->cv);
+    pthread_mutex_unlock(&c->mu);
+    return failed ? -1 : 0;
+}
+
+static int copy_entry(struct copy_ctx *c, const char *src, const char *dst){
+    struct stat st;
+    if (lstat(src, &st) != 0) return -1;
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(src, target, sizeof(target) - 1);
+        if (n < 0) return -1;
+        target[n] = '\0';
+        /* A relative link that stays inside at its source can leave the
+           jail once copied somewhere shallower. */
+        if (c->o->jail && !link_inside(c->o->jail, dst, target)) { errno = EPERM; return -1; }
+        return symlink(target, dst);
+    }
+    if (S_ISREG(st.st_mode)) return enqueue_file(c, src, dst, st.st_mode);
+    if (!S_ISDIR(st.st_mode)) { errno = EOPNOTSUPP; return -1; }
+
+    /* Merging into an existing tree: what is there must be a directory
+       itself, not a symlink that would carry the copy somewhere else. */
+    if (mkdir(dst, st.st_mode & 07777) != 0) {
+        struct stat ds;
+        if (errno != EEXIST) return -1;
+        if (lstat(dst, &ds) != 0) return -1;
+        if (!S_ISDIR(ds.st_mode)) { errno = ENOTDIR; return -1; }
+    }
+    DIR *d = opendir(src);
+    if (!d) return -1;
+    struct dirent *e;
+    char csrc[PATH_MAX], cdst[PATH_MAX];
+    int ret = 0;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        snprintf(csrc, sizeof(csrc), "%s/%s", src, e->d_name);
+        snprintf(cdst, sizeof(cdst), "%s/%s", dst, e->d_name);
+        if (copy_entry(c, csrc, cdst) != 0) { ret = -1; break; }
+    }
+    closedir(d);
+    return ret;
+}
+
+/* Refuses to copy a directory into itself; dst's parent must exist.
+   For a file, refuses dst being src. */
+static int dst_inside_src(const char *src, const char *dst){
+    char csrc[PATH_MAX], cdst[PATH_MAX], parent[PATH_MAX];
+    struct stat ss, ds;
+    if (stat(src, &ss) == 0 && !S_ISDIR(ss.st_mode))
+        return stat(dst, &ds) == 0 && ds.st_dev == ss.st_dev && ds.st_ino == ss.st_ino;
+    if (!realpath(src, csrc)) return 0;
+    strncpy(parent, dst, sizeof(parent) - 1);
+    parent[sizeof(parent) - 1] = '\0';
+    char *slash = strrchr(parent, '/');
+    if (!slash) strcpy(parent, ".");
+    else if (slash == parent) parent[1] = '\0';
+    else *slash = '\0';
+    if (!realpath(parent, cdst)) return 0;
+    size_t n = strlen(csrc);
+    return strncmp(cdst, csrc, n) == 0 && (cdst[n] == '/' || cdst[n] == '\0');
+}
+
+int copy_tree_ex(const char *src, const char *dst, struct copy_opts *o){
+    if (!src || !*src || !dst || !*dst || !o) return -1;
+    o->files = o->bytes = 0;
+    struct stat st;
+    if (lstat(src, &st) != 0) return -1;
+    if (dst_inside_src(src, dst)) { errno = EINVAL; return -1; }
+
+    struct copy_ctx c = { .o = o };
+    pthread_mutex_init(&c.mu, NULL);
+    pthread_cond_init(&c.cv, NULL);
+    int nw = S_ISDIR(st.st_mode) ? o->workers : 1;
+    if (nw > 64) nw = 64;
+    pthread_t tids[64];
+    int started = 0;
+    for (; nw > 1 && started < nw; started++)
+        if (pthread_create(&tids[started], NULL, copy_worker, &c) != 0) break;
+    c.pool = started > 0;
+
+    int ret = copy_entry(&c, src, dst);
+
+    pthread_mutex_lock(&c.mu);
+    c.done = 1;
+    pthread_cond_broadcast(&c.cv);
+    pthread_mutex_unlock(&c.mu);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    if (c.failed) ret = -1;
+    pthread_cond_destroy(&c.cv);
+    pthread_mutex_destroy(&c.mu);
+    return ret;
+}
+#endif
+
+int copy_tree(const char *src, const char *dst){
+    struct copy_opts o = { .workers = 1 };
+    return copy_tree_ex(src, dst, &o);
+}
@@ -0,0 +1,18 @@
+#ifndef COPY_TREE_H
+#define COPY_TREE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct copy_opts {
+    int workers;                /* parallel file copies; <= 1 copies inline */
+    unsigned long long files;   /* out: regular files copied */
+    unsigned long long bytes;   /* out: data bytes copied (holes excluded) */
+    const char *jail;           /* if set (canonical), symlinks whose target
+                                   leaves it at the destination are refused */
+};
+int copy_tree(const char *src, const char *dst);
+int copy_tree_ex(const char *src, const char *dst, struct copy_opts *o);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,763 @@
+#define _GNU_SOURCE
+#include "du_index.h"
+#include "find_tree.h"
+#include "manifest.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+struct du_link;
+
+struct du_node {
+    struct du_node *hnext;                  /* hash chain */
+    struct du_node *parent, *child, *sibling;
+    char *path;
+    struct timespec mtime;
+    struct du_totals own;                   /* regular files directly inside */
+    struct du_totals total;                 /* own plus every descendant */
+    struct du_link *links;                  /* multiply-linked files directly inside */
+    unsigned seen;
+};
+
+/* Files with more than one link when they were indexed. The inode's
+   bytes are charged to the directory of its first link; the other links
+   count as files only. When the charged link goes, the next one takes
+   the bytes over. A query adds the inodes charged outside the queried
+   directory but linked from inside it, so each counts once, as in du.
+   Only inodes linked from more than one directory can be such, and
+   those are kept on a list of their own. */
+struct du_ino {
+    struct du_ino *hnext;
+    dev_t dev;
+    ino_t ino;
+    struct du_totals size;                  /* bytes and alloc only */
+    struct du_link *links;
+    struct du_ino *sprev, *snext;           /* on du_split */
+    int split;
+};
+
+struct du_link {
+    struct du_ino *ino;
+    struct du_node *dir;
+    struct du_link *next_in_dir, *next_of_ino;
+};
+
+/* Shared by every process working on the same root: a ring of the
+   directories the hooks touched. A record is valid while its stamp is
+   its sequence number plus one. */
+#define DU_JOURNAL_SLOTS 1024
+#define DU_JOURNAL_PATH 496
+enum { DU_J_DIR = 1, DU_J_TREE = 2 };
+
+struct du_jrec {
+    uint64_t stamp;
+    int32_t pid;
+    uint32_t kind;
+    char rel[DU_JOURNAL_PATH];              /* relative to the root */
+};
+
+struct du_journal {
+    uint64_t head;                          /* next sequence number */
+    uint64_t reserved[7];
+    struct du_jrec rec[DU_JOURNAL_SLOTS];
+};
+
+/* One lock guards the whole index. Until the initial scan finishes the
+   hooks only record which directories they touched; those are then
+   re-read once the index is ready. */
+static pthread_mutex_t du_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct du_node **du_tab;
+static size_t du_cap, du_count;
+static char du_root[PATH_MAX];
+static size_t du_rootlen;
+static int du_ready, du_workers = 1;
+static unsigned du_gen;
+static unsigned du_reads;                   /* directories re-read from disk so far */
+static char **du_dirty;
+static size_t du_ndirty, du_dirtycap;
+static struct du_ino **ino_tab;
+static size_t ino_cap, ino_count;
+static struct du_ino *du_split;             /* inodes linked from several directories */
+static struct du_journal *du_jr;
+static uint64_t du_seen;                    /* journal records applied so far */
+
+static size_t du_hash(const char *s){
+    size_t h = 1469598103934665603ULL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static int in_root(const char *path){
+    return du_rootlen && strncmp(path, du_root, du_rootlen) == 0 &&
+           (path[du_rootlen] == '/' || path[du_rootlen] == '\0');
+}
+
+static int parent_of(const char *path, char *out, size_t outsz){
+    if (!strcmp(path, du_root)) return -1;
+    const char *slash = strrchr(path, '/');
+    if (!slash) return -1;
+    size_t n = (slash == path) ? 1 : (size_t)(slash - path);
+    if (n >= outsz) return -1;
+    memcpy(out, path, n);
+    out[n] = '\0';
+    return 0;
+}
+
+static struct du_node *node_find(const char *path){
+    if (!du_cap) return NULL;
+    for (struct du_node *n = du_tab[du_hash(path) & (du_cap - 1)]; n; n = n->hnext)
+        if (!strcmp(n->path, path)) return n;
+    return NULL;
+}
+
+static void tab_insert(struct du_node *n){
+    if (du_count + 1 > du_cap) {
+        size_t ncap = du_cap ? du_cap * 2 : 1024;
+        struct du_node **nt = calloc(ncap, sizeof(*nt));
+        if (!nt) abort();
+        for (size_t i = 0; i < du_cap; i++) {
+            while (du_tab[i]) {
+                struct du_node *m = du_tab[i];
+                du_tab[i] = m->hnext;
+                size_t b = du_hash(m->path) & (ncap - 1);
+                m->hnext = nt[b];
+                nt[b] = m;
+            }
+        }
+        free(du_tab);
+        du_tab = nt;
+        du_cap = ncap;
+    }
+    size_t b = du_hash(n->path) & (du_cap - 1);
+    n->hnext = du_tab[b];
+    du_tab[b] = n;
+    du_count++;
+}
+
+static void tab_remove(struct du_node *n){
+    struct du_node **pp = &du_tab[du_hash(n->path) & (du_cap - 1)];
+    while (*pp && *pp != n) pp = &(*pp)->hnext;
+    if (*pp) { *pp = n->hnext; du_count--; }
+}
+
+static void totals_apply(struct du_totals *t, const struct du_totals *d, int sign){
+    if (sign > 0) {
+        t->bytes += d->bytes; t->alloc += d->alloc; t->files += d->files; t->dirs += d->dirs;
+    } else {
+        t->bytes -= d->bytes; t->alloc -= d->alloc; t->files -= d->files; t->dirs -= d->dirs;
+    }
+}
+
+static void add_up(struct du_node *n, const struct du_totals *d, int sign){
+    for (; n; n = n->parent) totals_apply(&n->total, d, sign);
+}
+
+static void file_totals(const struct stat *st, struct du_totals *d){
+    memset(d, 0, sizeof(*d));
+    d->bytes = (unsigned long long)st->st_size;
+    d->alloc = (unsigned long long)st->st_blocks * 512ULL;
+    d->files = 1;
+}
+
+static size_t ino_hash(dev_t dev, ino_t ino){
+    return ((size_t)ino * 0x9E3779B97F4A7C15ULL) ^ (size_t)dev;
+}
+
+static struct du_ino *ino_get(const struct stat *st, int create){
+    if (ino_cap) {
+        for (struct du_ino *i = ino_tab[ino_hash(st->st_dev, st->st_ino) & (ino_cap - 1)]; i; i = i->hnext)
+            if (i->ino == st->st_ino && i->dev == st->st_dev) return i;
+    }
+    if (!create) return NULL;
+    if (ino_count + 1 > ino_cap) {
+        size_t ncap = ino_cap ? ino_cap * 2 : 256;
+        struct du_ino **nt = calloc(ncap, sizeof(*nt));
+        if (!nt) return NULL;
+        for (size_t b = 0; b < ino_cap; b++) {
+            while (ino_tab[b]) {
+                struct du_ino *m = ino_tab[b];
+                ino_tab[b] = m->hnext;
+                size_t nb = ino_hash(m->dev, m->ino) & (ncap - 1);
+                m->hnext = nt[nb];
+                nt[nb] = m;
+            }
+        }
+        free(ino_tab);
+        ino_tab = nt;
+        ino_cap = ncap;
+    }
+    struct du_ino *i = calloc(1, sizeof(*i));
+    if (!i) return NULL;
+    i->dev = st->st_dev;
+    i->ino = st->st_ino;
+    size_t b = ino_hash(i->dev, i->ino) & (ino_cap - 1);
+    i->hnext = ino_tab[b];
+    ino_tab[b] = i;
+    ino_count++;
+    return i;
+}
+
+/* Puts i on du_split, or takes it off, after its links changed. */
+static void ino_resplit(struct du_ino *i){
+    int split = 0;
+    for (struct du_link *l = i->links; l && !split; l = l->next_of_ino) split = l->dir != i->links->dir;
+    if (split == i->split) return;
+    i->split = split;
+    if (split) {
+        i->sprev = NULL;
+        if ((i->snext = du_split)) du_split->sprev = i;
+        du_split = i;
+    } else {
+        if (i->sprev) i->sprev->snext = i->snext; else du_split = i->snext;
+        if (i->snext) i->snext->sprev = i->sprev;
+    }
+}
+
+static void ino_free(struct du_ino *i){
+    if (i->split) ino_resplit(i);          /* no links left: comes off */
+    struct du_ino **pp = &ino_tab[ino_hash(i->dev, i->ino) & (ino_cap - 1)];
+    while (*pp && *pp != i) pp = &(*pp)->hnext;
+    if (*pp) { *pp = i->hnext; ino_count--; }
+    free(i);
+}
+
+/* What a regular file in dir adds to the index. */
+static void charge(struct du_node *dir, const struct stat *st, struct du_totals *d){
+    file_totals(st, d);
+    if (st->st_nlink < 2) return;
+    struct du_ino *i = ino_get(st, 1);
+    struct du_link *l = i ? calloc(1, sizeof(*l)) : NULL;
+    if (!l) return;
+    if (!i->links) { i->size = *d; i->size.files = 0; }
+    else d->bytes = d->alloc = 0;
+    l->ino = i;
+    l->dir = dir;
+    l->next_in_dir = dir->links;
+    dir->links = l;
+    struct du_link **pp = &i->links;
+    while (*pp) pp = &(*pp)->next_of_ino;
+    *pp = l;
+    ino_resplit(i);
+}
+
+/* Drops one link; returns what it was charged. Bytes it carried move to
+   the next link of the inode, wherever that is. */
+static void drop_link(struct du_link *l, struct du_totals *d){
+    struct du_ino *i = l->ino;
+    memset(d, 0, sizeof(*d));
+    d->files = 1;
+    struct du_link **pp = &l->dir->links;
+    while (*pp && *pp != l) pp = &(*pp)->next_in_dir;
+    if (*pp) *pp = l->next_in_dir;
+    int charged = i->links == l;
+    for (pp = &i->links; *pp && *pp != l; pp = &(*pp)->next_of_ino) {}
+    if (*pp) *pp = l->next_of_ino;
+    free(l);
+    if (i->links) ino_resplit(i);
+    if (!charged) return;
+    totals_apply(d, &i->size, 1);
+    if (!i->links) { ino_free(i); return; }
+    struct du_node *heir = i->links->dir;
+    totals_apply(&heir->own, &i->size, 1);
+    add_up(heir, &i->size, 1);
+}
+
+/* What removing a regular file from dir takes out of the index: the
+   charge it got when it was indexed, whatever its link count is now. */
+static void uncharge(struct du_node *dir, const struct stat *st, struct du_totals *d){
+    for (struct du_link *l = dir->links; l; l = l->next_in_dir)
+        if (l->ino->ino == st->st_ino && l->ino->dev == st->st_dev) { drop_link(l, d); return; }
+    file_totals(st, d);
+}
+
+/* Before dir's own totals are thrown away or recomputed. */
+static void drop_links(struct du_node *dir){
+    struct du_totals d;
+    while (dir->links) drop_link(dir->links, &d);
+}
+
+static struct du_node *node_ensure(const char *path){
+    if (!in_root(path)) return NULL;
+    struct du_node *n = node_find(path);
+    if (n) return n;
+    struct du_node *parent = NULL;
+    char pp[PATH_MAX];
+    if (parent_of(path, pp, sizeof(pp)) == 0 && !(parent = node_ensure(pp))) return NULL;
+    n = calloc(1, sizeof(*n));
+    if (!n || !(n->path = strdup(path))) { free(n); return NULL; }
+    n->parent = parent;
+    if (parent) {
+        n->sibling = parent->child;
+        parent->child = n;
+        struct du_totals one = { .dirs = 1 };
+        add_up(parent, &one, 1);
+    }
+    tab_insert(n);
+    return n;
+}
+
+static void free_subtree(struct du_node *n){
+    struct du_node *c = n->child;
+    while (c) { struct du_node *next = c->sibling; free_subtree(c); c = next; }
+    drop_links(n);
+    tab_remove(n);
+    free(n->path);
+    free(n);
+}
+
+static void unlink_node(struct du_node *n){
+    if (!n->parent) return;
+    struct du_totals t = n->total;
+    t.dirs += 1;
+    add_up(n->parent, &t, -1);
+    struct du_node **pp = &n->parent->child;
+    while (*pp && *pp != n) pp = &(*pp)->sibling;
+    if (*pp) *pp = n->sibling;
+    n->parent = NULL;
+    n->sibling = NULL;
+}
+
+static void node_remove(struct du_node *n){
+    unlink_node(n);
+    free_subtree(n);
+}
+
+static void touch_mtime(const char *dir){
+    struct du_node *n = node_find(dir);
+    struct stat st;
+    if (n && stat(dir, &st) == 0) n->mtime = st.st_mtim;
+}
+
+static void mark_dirty(const char *dir){
+    for (size_t i = 0; i < du_ndirty; i++) if (!strcmp(du_dirty[i], dir)) return;
+    if (du_ndirty == du_dirtycap) {
+        size_t ncap = du_dirtycap ? du_dirtycap * 2 : 64;
+        char **nd = realloc(du_dirty, ncap * sizeof(*nd));
+        if (!nd) return;
+        du_dirty = nd;
+        du_dirtycap = ncap;
+    }
+    char *copy = strdup(dir);
+    if (copy) du_dirty[du_ndirty++] = copy;
+}
+
+static void mark_parent_dirty(const char *path){
+    char pp[PATH_MAX];
+    mark_dirty(parent_of(path, pp, sizeof(pp)) == 0 ? pp : path);
+}
+
+/* ---- scanning ---- */
+struct scan_ctx {
+    const char *base;
+    int locked;                 /* caller already holds du_mu */
+};
+
+static int scan_entry(void *user, const char *rel, const struct stat *st){
+    struct scan_ctx *sc = user;
+    char abs[PATH_MAX];
+    if (!st || snprintf(abs, sizeof(abs), "%s/%s", sc->base, rel) >= (int)sizeof(abs)) return 0;
+    if (!sc->locked) pthread_mutex_lock(&du_mu);
+    if (S_ISDIR(st->st_mode)) {
+        struct du_node *n = node_ensure(abs);
+        if (n) n->mtime = st->st_mtim;
+    } else if (S_ISREG(st->st_mode)) {
+        char pp[PATH_MAX];
+        struct du_node *p = parent_of(abs, pp, sizeof(pp)) == 0 ? node_ensure(pp) : NULL;
+        if (p) {
+            struct du_totals d;
+            charge(p, st, &d);
+            totals_apply(&p->own, &d, 1);
+            add_up(p, &d, 1);
+        }
+    }
+    if (!sc->locked) pthread_mutex_unlock(&du_mu);
+    return 0;
+}
+
+static int scan_into_index(const char *dir, int locked){
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct find_query q = { .min_size = -1, .max_size = -1, .want_stat = 1, .workers = du_workers };
+    struct scan_ctx sc = { dir, locked };
+    int rc = find_tree(fd, &q, scan_entry, NULL, &sc, NULL);
+    close(fd);
+    return rc;
+}
+
+/* (Re)indexes one subtree from scratch. Caller holds du_mu. */
+static void add_tree_locked(const char *dir){
+    struct stat st;
+    du_reads++;
+    struct du_node *n = node_find(dir);
+    if (n) node_remove(n);
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return;
+    if (!(n = node_ensure(dir))) return;
+    n->mtime = st.st_mtim;
+    scan_into_index(dir, 1);
+}
+
+/* Re-reads one directory's entries: recomputes its own file totals,
+   drops vanished subdirectories and indexes new ones. */
+static void refresh_locked(const char *dir){
+    struct du_node *n = node_find(dir);
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        if (n) node_remove(n);
+        return;
+    }
+    if (!n) { add_tree_locked(dir); return; }
+
+    du_reads++;
+    DIR *d = opendir(dir);
+    if (!d) return;
+    drop_links(n);
+    unsigned gen = ++du_gen;
+    struct du_totals own = {0}, ft;
+    struct dirent *e;
+    char child[PATH_MAX];
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        if (manifest_hidden_at(dirfd(d), e->d_name)) continue;
+        struct stat cst;
+        if (snprintf(child, sizeof(child), "%s/%s", dir, e->d_name) >= (int)sizeof(child)) continue;
+        if (fstatat(dirfd(d), e->d_name, &cst, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(cst.st_mode)) {
+            struct du_node *c = node_find(child);
+            if (!c) { add_tree_locked(child); c = node_find(child); }
+            if (c) c->seen = gen;
+        } else if (S_ISREG(cst.st_mode)) {
+            charge(n, &cst, &ft);
+            totals_apply(&own, &ft, 1);
+        }
+    }
+    closedir(d);
+
+    for (struct du_node *c = n->child, *next; c; c = next) {
+        next = c->sibling;
+        if (c->seen != gen) node_remove(c);
+    }
+    add_up(n, &n->own, -1);
+    add_up(n, &own, 1);
+    n->own = own;
+    n->mtime = st.st_mtim;
+}
+
+/* ---- journal ---- */
+static void publish(int kind, const char *path){
+    if (!du_jr || !in_root(path)) return;
+    const char *rel = path + du_rootlen + (path[du_rootlen] == '/');
+    size_t n = strlen(rel);
+    /* A path too long for a record: re-index the deepest ancestor that fits. */
+    while (n >= DU_JOURNAL_PATH) {
+        while (n > 0 && rel[n - 1] != '/') n--;
+        n = n > 0 ? n - 1 : 0;
+        kind = DU_J_TREE;
+    }
+    uint64_t seq = __atomic_fetch_add(&du_jr->head, 1, __ATOMIC_ACQ_REL);
+    struct du_jrec *r = &du_jr->rec[seq % DU_JOURNAL_SLOTS];
+    __atomic_store_n(&r->stamp, 0, __ATOMIC_RELEASE);
+    r->pid = (int32_t)getpid();
+    r->kind = (uint32_t)kind;
+    memcpy(r->rel, rel, n);
+    r->rel[n] = '\0';
+    __atomic_store_n(&r->stamp, seq + 1, __ATOMIC_RELEASE);
+}
+
+static void publish_parent(int kind, const char *path){
+    char pp[PATH_MAX];
+    if (parent_of(path, pp, sizeof(pp)) == 0) publish(kind, pp);
+}
+
+/* Applies what other processes recorded since the last call. A record
+   still being written stops the walk until next time; one already
+   overwritten means this process fell too far behind, and only a full
+   re-scan is right then. Queries and the hooks call it, so a process
+   that does neither for DU_JOURNAL_SLOTS changes pays that re-scan at
+   its next query. Caller holds du_mu. */
+static void sync_locked(void){
+    if (!du_jr || !du_ready) return;
+    uint64_t head = __atomic_load_n(&du_jr->head, __ATOMIC_ACQUIRE);
+    int32_t self = (int32_t)getpid();
+    for (; du_seen < head; du_seen++) {
+        struct du_jrec *r = &du_jr->rec[du_seen % DU_JOURNAL_SLOTS];
+        struct du_jrec copy;
+        uint64_t stamp = __atomic_load_n(&r->stamp, __ATOMIC_ACQUIRE);
+        if (stamp == du_seen + 1) {
+            memcpy(&copy, r, sizeof(copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r->stamp, __ATOMIC_RELAXED) != stamp) stamp = 0;
+        }
+        if (stamp != du_seen + 1) {
+            if (head - du_seen <= DU_JOURNAL_SLOTS && stamp < du_seen + 1) return;
+            add_tree_locked(du_root);
+            du_seen = head;
+            return;
+        }
+        if (copy.pid == self) continue;
+        char abs[PATH_MAX];
+        copy.rel[DU_JOURNAL_PATH - 1] = '\0';
+        if (snprintf(abs, sizeof(abs), "%s%s%s", du_root, *copy.rel ? "/" : "", copy.rel) >= (int)sizeof(abs))
+            continue;
+        if (copy.kind == DU_J_TREE) add_tree_locked(abs);
+        else refresh_locked(abs);
+    }
+}
+
+static void journal_open(const char *file){
+    int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (st.st_size == sizeof(*du_jr) || ftruncate(fd, sizeof(*du_jr)) == 0)) {
+        void *p = mmap(NULL, sizeof(*du_jr), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            du_jr = p;
+            du_seen = __atomic_load_n(&du_jr->head, __ATOMIC_ACQUIRE);
+        }
+    }
+    close(fd);
+}
+
+static void *initial_scan(void *arg){
+    (void)arg;
+    scan_into_index(du_root, 0);
+    pthread_mutex_lock(&du_mu);
+    du_ready = 1;
+    for (size_t i = 0; i < du_ndirty; i++) { refresh_locked(du_dirty[i]); free(du_dirty[i]); }
+    free(du_dirty);
+    du_dirty = NULL;
+    du_ndirty = du_dirtycap = 0;
+    pthread_mutex_unlock(&du_mu);
+    return NULL;
+}
+
+int du_index_start(const char *root, const char *journal, int workers){
+    struct stat st;
+    if (stat(root, &st) != 0 || strlen(root) >= sizeof(du_root)) return -1;
+    pthread_mutex_lock(&du_mu);
+    /* Before the scan starts: it may or may not see a change recorded
+       meanwhile, so those are applied again once it is done. */
+    if (journal) journal_open(journal);
+    strcpy(du_root, root);
+    du_rootlen = strlen(du_root);
+    du_workers = workers < 1 ? 1 : workers;
+    struct du_node *r = node_ensure(du_root);
+    if (r) r->mtime = st.st_mtim;
+    pthread_mutex_unlock(&du_mu);
+    if (!r) return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, initial_scan, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+static int under(const struct du_node *d, const struct du_node *top){
+    for (; d; d = d->parent) if (d == top) return 1;
+    return 0;
+}
+
+static void add_outside_charged(const struct du_node *n, struct du_totals *t){
+    for (struct du_ino *i = du_split; i; i = i->snext) {
+        if (under(i->links->dir, n)) continue;
+        for (struct du_link *l = i->links->next_of_ino; l; l = l->next_of_ino)
+            if (under(l->dir, n)) { totals_apply(t, &i->size, 1); break; }
+    }
+}
+
+/* Catches up with the journal, then answers from the index. Only dir
+   itself is checked against its mtime, for a change made behind the
+   server's back; the rest of the subtree is trusted to the hooks and
+   the journal, so a query costs the changes since the last one, not
+   the size of the tree. */
+int du_index_query(const char *dir, struct du_totals *out){
+    pthread_mutex_lock(&du_mu);
+    if (!du_ready || !in_root(dir)) { pthread_mutex_unlock(&du_mu); return -1; }
+    sync_locked();
+    struct du_node *n = node_find(dir);
+    struct stat st;
+    if (!n || stat(dir, &st) != 0 || st.st_mtim.tv_sec != n->mtime.tv_sec || st.st_mtim.tv_nsec != n->mtime.tv_nsec) {
+        refresh_locked(dir);
+        n = node_find(dir);
+    }
+    if (n) { *out = n->total; add_outside_charged(n, out); }
+    pthread_mutex_unlock(&du_mu);
+    return n ? 0 : -1;
+}
+
+struct sum_ctx {
+    struct du_totals *t;
+    struct stat *seen;                      /* multiply-linked inodes met so far */
+    size_t nseen, capseen;
+};
+
+/* Whether this inode was already counted; remembers it otherwise. */
+static int seen_before(struct sum_ctx *sc, const struct stat *st){
+    for (size_t i = 0; i < sc->nseen; i++)
+        if (sc->seen[i].st_ino == st->st_ino && sc->seen[i].st_dev == st->st_dev) return 1;
+    if (sc->nseen == sc->capseen) {
+        size_t ncap = sc->capseen ? sc->capseen * 2 : 64;
+        struct stat *ns = realloc(sc->seen, ncap * sizeof(*ns));
+        if (!ns) return 0;
+        sc->seen = ns;
+        sc->capseen = ncap;
+    }
+    sc->seen[sc->nseen++] = *st;
+    return 0;
+}
+
+static int sum_entry(void *user, const char *rel, const struct stat *st){
+    (void)rel;
+    struct sum_ctx *sc = user;
+    struct du_totals d;
+    if (!st) return 0;
+    if (S_ISDIR(st->st_mode)) sc->t->dirs++;
+    else if (S_ISREG(st->st_mode)) {
+        file_totals(st, &d);
+        if (st->st_nlink > 1 && seen_before(sc, st)) d.bytes = d.alloc = 0;
+        totals_apply(sc->t, &d, 1);
+    }
+    return 0;
+}
+
+int du_scan(const char *dir, struct du_totals *out, int workers){
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct find_query q = { .min_size = -1, .max_size = -1, .want_stat = 1, .workers = workers };
+    memset(out, 0, sizeof(*out));
+    struct sum_ctx sc = { .t = out };
+    int rc = find_tree(fd, &q, sum_entry, NULL, &sc, NULL);
+    free(sc.seen);
+    close(fd);
+    return rc < 0 ? -1 : 0;
+}
+
+unsigned du_index_epoch(void){
+    pthread_mutex_lock(&du_mu);
+    unsigned e = du_reads;
+    pthread_mutex_unlock(&du_mu);
+    return e;
+}
+
+/* ---- mutation hooks ----
+   Each also catches up with the journal once its own change is in:
+   a directory re-read from disk is right whatever was applied before. */
+void du_index_file(const char *path, const struct stat *before, const struct stat *after, unsigned epoch){
+    char pp[PATH_MAX];
+    if (!in_root(path) || parent_of(path, pp, sizeof(pp)) != 0) return;
+    pthread_mutex_lock(&du_mu);
+    publish(DU_J_DIR, pp);
+    if (!du_ready) { mark_dirty(pp); pthread_mutex_unlock(&du_mu); return; }
+    struct du_node *p = node_find(pp);
+    /* Something was re-read while the caller was changing the
+       directory: the change may be counted already. */
+    if (!p || du_reads != epoch) {
+        refresh_locked(pp);
+        sync_locked();
+        pthread_mutex_unlock(&du_mu);
+        return;
+    }
+    struct du_totals d;
+    if (before && S_ISREG(before->st_mode)) {
+        uncharge(p, before, &d);
+        totals_apply(&p->own, &d, -1);
+        add_up(p, &d, -1);
+    }
+    if (after && S_ISREG(after->st_mode)) {
+        charge(p, after, &d);
+        totals_apply(&p->own, &d, 1);
+        add_up(p, &d, 1);
+    }
+    if (!before || !after) touch_mtime(pp);
+    sync_locked();
+    pthread_mutex_unlock(&du_mu);
+}
+
+void du_index_add_tree(const char *dir){
+    char pp[PATH_MAX];
+    if (!in_root(dir)) return;
+    pthread_mutex_lock(&du_mu);
+    publish(DU_J_TREE, dir);
+    if (!du_ready) mark_parent_dirty(dir);
+    else {
+        add_tree_locked(dir);
+        if (parent_of(dir, pp, sizeof(pp)) == 0) touch_mtime(pp);
+    }
+    sync_locked();
+    pthread_mutex_unlock(&du_mu);
+}
+
+void du_index_remove_tree(const char *dir){
+    char pp[PATH_MAX];
+    if (!in_root(dir)) return;
+    pthread_mutex_lock(&du_mu);
+    publish_parent(DU_J_DIR, dir);
+    if (!du_ready) mark_parent_dirty(dir);
+    else {
+        struct du_node *n = node_find(dir);
+        if (n) node_remove(n);
+        if (parent_of(dir, pp, sizeof(pp)) == 0) touch_mtime(pp);
+    }
+    sync_locked();
+    pthread_mutex_unlock(&du_mu);
+}
+
+static void rekey_subtree(struct du_node *n, size_t oldlen, const char *to){
+    char np[PATH_MAX];
+    tab_remove(n);
+    snprintf(np, sizeof(np), "%s%s", to, n->path + oldlen);
+    char *copy = strdup(np);
+    if (copy) { free(n->path); n->path = copy; }
+    tab_insert(n);
+    for (struct du_node *c = n->child; c; c = c->sibling) rekey_subtree(c, oldlen, to);
+}
+
+void du_index_move_tree(const char *from, const char *to){
+    char pfrom[PATH_MAX], pto[PATH_MAX];
+    if (!in_root(from) || !in_root(to)) return;
+    if (parent_of(from, pfrom, sizeof(pfrom)) != 0 || parent_of(to, pto, sizeof(pto)) != 0) return;
+    pthread_mutex_lock(&du_mu);
+    publish(DU_J_DIR, pfrom);
+    publish(DU_J_TREE, to);
+    if (!du_ready) { mark_dirty(pfrom); mark_dirty(pto); pthread_mutex_unlock(&du_mu); return; }
+    struct du_node *n = node_find(from), *old = node_find(to), *np;
+    if (old && old != n) node_remove(old);
+    if (!n || !(np = node_ensure(pto))) {
+        if (n) node_remove(n);
+        add_tree_locked(to);
+    } else {
+        unlink_node(n);
+        rekey_subtree(n, strlen(from), to);
+        n->parent = np;
+        n->sibling = np->child;
+        np->child = n;
+        struct du_totals t = n->total;
+        t.dirs += 1;
+        add_up(np, &t, 1);
+    }
+    touch_mtime(pfrom);
+    touch_mtime(pto);
+    sync_locked();
+    pthread_mutex_unlock(&du_mu);
+}
+
+void du_index_refresh(const char *dir){
+    if (!in_root(dir)) return;
+    pthread_mutex_lock(&du_mu);
+    publish(DU_J_DIR, dir);
+    if (!du_ready) mark_dirty(dir);
+    else refresh_locked(dir);
+    sync_locked();
+    pthread_mutex_unlock(&du_mu);
+}
@@ -0,0 +1,37 @@
+#ifndef DU_INDEX_H
+#define DU_INDEX_H
+#include <sys/stat.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct du_totals {
+    unsigned long long bytes;   /* apparent size of regular files */
+    unsigned long long alloc;   /* allocated blocks, in bytes */
+    unsigned long long files;
+    unsigned long long dirs;    /* subdirectories, not counting the directory itself */
+};
+
+/* Per-directory aggregates for the tree under root, built by a background
+   parallel scan and kept current by the mutation hooks below. All paths
+   are canonical absolute paths; anything outside root is ignored.
+   A file with several links counts its bytes once per query, as in du.
+   Every process keeps its own index. The hooks also append the
+   directories they touched to a journal file shared by all processes,
+   and each process re-reads those directories at its next query or
+   hook. Changes made without the hooks are only noticed in the queried
+   directory itself. */
+int  du_index_start(const char *root, const char *journal, int workers);
+int  du_index_query(const char *dir, struct du_totals *out);
+int  du_scan(const char *dir, struct du_totals *out, int workers);
+
+/* epoch: du_index_epoch() taken before the file was changed. */
+unsigned du_index_epoch(void);
+void du_index_file(const char *path, const struct stat *before, const struct stat *after, unsigned epoch);
+void du_index_add_tree(const char *dir);
+void du_index_remove_tree(const char *dir);
+void du_index_move_tree(const char *from, const char *to);
+void du_index_refresh(const char *dir);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "find_tree.h"
+#include "manifest.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+/* Directories waiting in the queue each hold an open fd; past this many
+   a worker descends inline instead, which bounds fd usage. */
+#define FIND_MAX_QUEUED 256
+
+struct find_dir {
+    struct find_dir *next;
+    int fd;
+    char *rel;
+};
+
+struct find_ctx {
+    const struct find_query *q;
+    find_match_fn on_match;
+    void *user;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    struct find_dir *head, *tail;
+    int queued, active, finished;
+    volatile int stop;
+    unsigned long matches;
+};
+
+static int needs_stat(const struct find_query *q){
+    return q->want_stat || q->min_size >= 0 || q->max_size >= 0 || q->newer_than || q->older_than;
+}
+
+static int matches_query(const struct find_query *q, const char *name, const struct stat *st){
+    if (q->name_glob && fnmatch(q->name_glob, name, 0) != 0) return 0;
+    if (q->min_size >= 0 || q->max_size >= 0) {
+        if (!st || !S_ISREG(st->st_mode)) return 0;
+        if (q->min_size >= 0 && st->st_size < q->min_size) return 0;
+        if (q->max_size >= 0 && st->st_size > q->max_size) return 0;
+    }
+    if (q->newer_than && (!st || st->st_mtime <= q->newer_than)) return 0;
+    if (q->older_than && (!st || st->st_mtime >= q->older_than)) return 0;
+    return 1;
+}
+
+static void report(struct find_ctx *c, const char *rel, const struct stat *st){
+    pthread_mutex_lock(&c->mu);
+    if (!c->stop) {
+        if (c->on_match(c->user, rel, st) != 0) c->stop = FIND_CANCELLED;
+        else if (++c->matches == c->q->limit) c->stop = FIND_LIMIT;
+        if (c->stop) pthread_cond_broadcast(&c->cv);
+    }
+    pthread_mutex_unlock(&c->mu);
+}
+
+/* Returns 1 if the directory was queued, 0 if the caller should descend
+   into it itself. Takes ownership of fd and rel only when queued. */
+static int try_enqueue(struct find_ctx *c, int fd, char *rel){
+    struct find_dir *d = NULL;
+    pthread_mutex_lock(&c->mu);
+    if (c->queued < FIND_MAX_QUEUED && (d = malloc(sizeof(*d)))) {
+        d->next = NULL; d->fd = fd; d->rel = rel;
+        if (c->tail) c->tail->next = d; else c->head = d;
+        c->tail = d;
+        c->queued++;
+        pthread_cond_signal(&c->cv);
+    }
+    pthread_mutex_unlock(&c->mu);
+    return d != NULL;
+}
+
+static void scan_dir(struct find_ctx *c, int fd, const char *rel){
+    DIR *d = fdopendir(fd);
+    if (!d) { close(fd); return; }
+    int want_stat = needs_stat(c->q);
+    struct dirent *e;
+    while (!c->stop && (e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        if (manifest_hidden_at(dirfd(d), e->d_name)) continue;
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", e->d_name) >= (int)sizeof(child))
+            continue;
+
+        struct stat st, *stp = NULL;
+        int is_dir = e->d_type == DT_DIR;
+        if (want_stat || e->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            stp = &st;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (matches_query(c->q, e->d_name, stp)) report(c, child, stp);
+        if (!is_dir) continue;
+
+        int sub = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub < 0) continue;
+        char *copy = strdup(child);
+        if (copy && try_enqueue(c, sub, copy)) continue;
+        free(copy);
+        scan_dir(c, sub, child);
+    }
+    closedir(d);
+}
+
+static void *find_worker(void *arg){
+    struct find_ctx *c = arg;
+    pthread_mutex_lock(&c->mu);
+    for (;;) {
+        while (!c->head && c->active > 0 && !c->stop) pthread_cond_wait(&c->cv, &c->mu);
+        if (!c->head || c->stop) break;
+        struct find_dir *d = c->head;
+        c->head = d->next;
+        if (!c->head) c->tail = NULL;
+        c->queued--;
+        c->active++;
+        pthread_mutex_unlock(&c->mu);
+
+        scan_dir(c, d->fd, d->rel);
+        free(d->rel);
+        free(d);
+
+        pthread_mutex_lock(&c->mu);
+        c->active--;
+        if (!c->head && c->active == 0) pthread_cond_broadcast(&c->cv);
+    }
+    c->finished++;
+    pthread_cond_broadcast(&c->cv);
+    pthread_mutex_unlock(&c->mu);
+    return NULL;
+}
+
+int find_tree(int dirfd, const struct find_query *q, find_match_fn on_match,
+              find_stop_fn should_stop, void *user, unsigned long *matches){
+    int fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    char *rel = strdup("");
+    if (fd < 0 || !rel) { if (fd >= 0) close(fd); free(rel); return -1; }
+
+    struct find_ctx c = { .q = q, .on_match = on_match, .user = user };
+    pthread_mutex_init(&c.mu, NULL);
+    pthread_cond_init(&c.cv, NULL);
+    try_enqueue(&c, fd, rel);
+
+    int nw = q->workers < 1 ? 1 : (q->workers > 64 ? 64 : q->workers);
+    pthread_t tids[64];
+    int started = 0;
+    for (; started < nw; started++)
+        if (pthread_create(&tids[started], NULL, find_worker, &c) != 0) break;
+    if (started == 0) find_worker(&c);
+
+    pthread_mutex_lock(&c.mu);
+    while (c.finished < started) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 50 * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&c.cv, &c.mu, &ts);
+        if (!c.stop && should_stop) {
+            pthread_mutex_unlock(&c.mu);
+            int s = should_stop(user);
+            pthread_mutex_lock(&c.mu);
+            if (s && !c.stop) { c.stop = FIND_CANCELLED; pthread_cond_broadcast(&c.cv); }
+        }
+    }
+    pthread_mutex_unlock(&c.mu);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    while (c.head) {
+        struct find_dir *d = c.head;
+        c.head = d->next;
+        close(d->fd); free(d->rel); free(d);
+    }
+    pthread_cond_destroy(&c.cv);
+    pthread_mutex_destroy(&c.mu);
+    if (matches) *matches = c.matches;
+    return c.stop;
+}
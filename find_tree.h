@@ -0,0 +1,30 @@
+#ifndef FIND_TREE_H
+#define FIND_TREE_H
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+enum { FIND_DONE = 0, FIND_LIMIT = 1, FIND_CANCELLED = 2 };
+
+struct find_query {
+    const char *name_glob;          /* fnmatch pattern on the entry name; NULL: any */
+    long long min_size, max_size;   /* regular files only; < 0: unbounded */
+    time_t newer_than, older_than;  /* mtime bounds; 0: unbounded */
+    unsigned long limit;            /* stop after this many matches; 0: unlimited */
+    int want_stat;                  /* pass a stat to on_match even without predicates */
+    int workers;
+};
+
+/* on_match is serialized and may return nonzero to stop the walk. st is
+   NULL when no predicate needed a stat. should_stop is polled by the
+   calling thread while workers run. */
+typedef int (*find_match_fn)(void *user, const char *relpath, const struct stat *st);
+typedef int (*find_stop_fn)(void *user);
+
+int find_tree(int dirfd, const struct find_query *q, find_match_fn on_match,
+              find_stop_fn should_stop, void *user, unsigned long *matches);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include "manifest.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+#define MANIFEST_MAGIC "SRVMAN01"
+#define MANIFEST_INITIAL_CAP 4096
+
+enum { REC_EMPTY = 0, REC_USED = 1, REC_DELETED = 2 };
+
+struct manifest_hdr {                   /* 64 bytes, followed by cap records */
+    char magic[8];
+    uint64_t cap;
+    uint64_t used;
+    uint64_t deleted;
+    uint32_t stale;                     /* set once a grown copy replaced this file */
+    uint32_t reserved[7];
+};
+
+/* The table is shared by every process that maps the file; flock
+   serializes access between them, mf_mu between a process's threads
+   (which share the descriptor, and so the flock). Growing writes a
+   bigger copy next to the file and renames it into place, so other
+   mappers notice the stale flag and re-open. */
+static pthread_mutex_t mf_mu = PTHREAD_MUTEX_INITIALIZER;
+static char mf_file[PATH_MAX];
+static int mf_fd = -1;
+static struct manifest_hdr *mf_hdr;
+static struct manifest_rec *mf_recs;
+static size_t mf_maplen;
+
+static uint64_t mf_hash(const char *s){
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static void mf_unmap(void){
+    if (mf_hdr) munmap(mf_hdr, mf_maplen);
+    if (mf_fd >= 0) close(mf_fd);
+    mf_hdr = NULL; mf_recs = NULL; mf_fd = -1; mf_maplen = 0;
+}
+
+static int mf_map(int fd, uint64_t cap_if_new, struct manifest_hdr **hdr, size_t *len){
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    size_t want = sizeof(struct manifest_hdr) + cap_if_new * sizeof(struct manifest_rec);
+    int fresh = st.st_size == 0;
+    if (fresh && ftruncate(fd, (off_t)want) != 0) return -1;
+    size_t maplen = fresh ? want : (size_t)st.st_size;
+    if (maplen < sizeof(struct manifest_hdr)) return -1;
+    void *p = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return -1;
+    struct manifest_hdr *h = p;
+    if (fresh) {
+        memcpy(h->magic, MANIFEST_MAGIC, 8);
+        h->cap = cap_if_new;
+    } else if (memcmp(h->magic, MANIFEST_MAGIC, 8) != 0 ||
+               sizeof(*h) + h->cap * sizeof(struct manifest_rec) != maplen) {
+        munmap(p, maplen);
+        errno = EINVAL;
+        return -1;
+    }
+    *hdr = h;
+    *len = maplen;
+    return 0;
+}
+
+static int mf_reopen(void){
+    mf_unmap();
+    int fd = open(mf_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    flock(fd, LOCK_EX);
+    struct manifest_hdr *h;
+    size_t len;
+    int rc = mf_map(fd, MANIFEST_INITIAL_CAP, &h, &len);
+    flock(fd, LOCK_UN);
+    if (rc != 0) { close(fd); return -1; }
+    mf_fd = fd; mf_hdr = h; mf_maplen = len;
+    mf_recs = (struct manifest_rec *)(h + 1);
+    return 0;
+}
+
+/* Takes the file lock, re-opening first if another process replaced the
+   file. Caller holds mf_mu. */
+static int mf_lock_file(int op){
+    for (int tries = 0; tries < 4; tries++) {
+        if (mf_fd < 0 && mf_reopen() != 0) return -1;
+        flock(mf_fd, op);
+        if (!mf_hdr->stale) return 0;
+        flock(mf_fd, LOCK_UN);
+        mf_unmap();
+    }
+    return -1;
+}
+
+static int mf_lock(int op){
+    pthread_mutex_lock(&mf_mu);
+    if (mf_lock_file(op) == 0) return 0;
+    pthread_mutex_unlock(&mf_mu);
+    return -1;
+}
+
+/* Also after a failed mf_grow, which may have lost the file lock. */
+static void mf_unlock(void){
+    if (mf_fd >= 0) flock(mf_fd, LOCK_UN);
+    pthread_mutex_unlock(&mf_mu);
+}
+
+static struct manifest_rec *mf_slot(struct manifest_rec *recs, uint64_t cap, const char *rel, int for_insert){
+    uint64_t mask = cap - 1, i = mf_hash(rel) & mask;
+    struct manifest_rec *tomb = NULL;
+    for (uint64_t n = 0; n < cap; n++, i = (i + 1) & mask) {
+        struct manifest_rec *r = &recs[i];
+        if (r->state == REC_EMPTY) return for_insert ? (tomb ? tomb : r) : NULL;
+        if (r->state == REC_DELETED) { if (!tomb) tomb = r; continue; }
+        if (!strcmp(r->path, rel)) return r;
+    }
+    return for_insert ? tomb : NULL;
+}
+
+/* Caller holds mf_mu and LOCK_EX, and still does on success, possibly
+   on a newer file. Rehashing drops tombstones, so the new table is sized from the
+   live entries rather than simply doubled. */
+static int mf_grow(void){
+    uint64_t cap = MANIFEST_INITIAL_CAP;
+    while (cap < (mf_hdr->used + 1) * 2) cap *= 2;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.new", mf_file);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    struct manifest_hdr *h;
+    size_t len;
+    if (mf_map(fd, cap, &h, &len) != 0) { close(fd); unlink(tmp); return -1; }
+    struct manifest_rec *recs = (struct manifest_rec *)(h + 1);
+    for (uint64_t i = 0; i < mf_hdr->cap; i++) {
+        if (mf_recs[i].state != REC_USED) continue;
+        *mf_slot(recs, h->cap, mf_recs[i].path, 1) = mf_recs[i];
+        h->used++;
+    }
+    if (msync(h, len, MS_SYNC) != 0 || rename(tmp, mf_file) != 0) {
+        munmap(h, len); close(fd); unlink(tmp);
+        return -1;
+    }
+    mf_hdr->stale = 1;
+    flock(mf_fd, LOCK_UN);
+    munmap(mf_hdr, mf_maplen);
+    close(mf_fd);
+    flock(fd, LOCK_EX);
+    mf_fd = fd; mf_hdr = h; mf_maplen = len;
+    mf_recs = recs;
+    /* Between the rename and this lock another process may have opened
+       the new file, grown it in turn and renamed a third one into place. */
+    if (h->stale) {
+        flock(fd, LOCK_UN);
+        mf_unmap();
+        return mf_lock_file(LOCK_EX);
+    }
+    return 0;
+}
+
+/* Caller holds LOCK_EX. Keeps the load (tombstones included) under 3/4
+   for one more entry. */
+static int mf_reserve(void){
+    while ((mf_hdr->used + mf_hdr->deleted + 1) * 4 > mf_hdr->cap * 3)
+        if (mf_grow() != 0) return -1;
+    return 0;
+}
+
+/* Caller holds LOCK_EX. */
+static void mf_kill(struct manifest_rec *r){
+    r->state = REC_DELETED;
+    mf_hdr->used--;
+    mf_hdr->deleted++;
+}
+
+/* Whether path is rel or lies below it ("" is the jail root). */
+static int mf_under(const char *path, const char *rel){
+    size_t n = strlen(rel);
+    return n == 0 || (strncmp(path, rel, n) == 0 && (path[n] == '\0' || path[n] == '/'));
+}
+
+static dev_t mf_hide_dev;
+static ino_t mf_hide_ino;
+static int mf_hiding;
+
+int manifest_hide(const char *dir){
+    struct stat st;
+    if (stat(dir, &st) != 0) return -1;
+    mf_hide_dev = st.st_dev;
+    mf_hide_ino = st.st_ino;
+    mf_hiding = 1;
+    return 0;
+}
+
+static int private_name(const char *name){
+    size_t n = strlen(MANIFEST_NAME);
+    return strncmp(name, MANIFEST_NAME, n) == 0 && (name[n] == '\0' || name[n] == '.');
+}
+
+static int in_hidden_dir(const struct stat *st){
+    return st->st_dev == mf_hide_dev && st->st_ino == mf_hide_ino;
+}
+
+int manifest_hidden_at(int dirfd, const char *name){
+    struct stat st;
+    return mf_hiding && private_name(name) && fstat(dirfd, &st) == 0 && in_hidden_dir(&st);
+}
+
+int manifest_hidden(const char *dir, const char *name){
+    struct stat st;
+    return mf_hiding && private_name(name) && stat(dir, &st) == 0 && in_hidden_dir(&st);
+}
+
+int manifest_open(const char *file){
+    if (strlen(file) >= sizeof(mf_file)) return -1;
+    strcpy(mf_file, file);
+    return mf_reopen();
+}
+
+int manifest_get(const char *rel, struct manifest_rec *out){
+    if (mf_lock(LOCK_SH) != 0) return -1;
+    struct manifest_rec *r = mf_slot(mf_recs, mf_hdr->cap, rel, 0);
+    if (r) *out = *r;
+    mf_unlock();
+    return r ? 0 : -1;
+}
+
+int manifest_put(const char *rel, uint64_t size, int64_t mtime_ns, const unsigned char hash[SHA256_LEN]){
+    if (strlen(rel) >= MANIFEST_PATH_MAX) return -1;
+    if (mf_lock(LOCK_EX) != 0) return -1;
+    if (mf_reserve() != 0) {
+        mf_unlock();
+        return -1;
+    }
+    struct manifest_rec *r = mf_slot(mf_recs, mf_hdr->cap, rel, 1);
+    if (!r) { mf_unlock(); return -1; }
+    if (r->state != REC_USED) {
+        if (r->state == REC_DELETED) mf_hdr->deleted--;
+        mf_hdr->used++;
+        memset(r, 0, sizeof(*r));
+        strcpy(r->path, rel);
+    }
+    r->size = size;
+    r->mtime_ns = mtime_ns;
+    memcpy(r->hash, hash, SHA256_LEN);
+    r->state = REC_USED;
+    mf_unlock();
+    return 0;
+}
+
+void manifest_del(const char *rel){
+    if (mf_lock(LOCK_EX) != 0) return;
+    struct manifest_rec *r = mf_slot(mf_recs, mf_hdr->cap, rel, 0);
+    if (r) mf_kill(r);
+    mf_unlock();
+}
+
+/* Subtrees are not indexed: these walk the whole table. */
+void manifest_del_tree(const char *rel){
+    if (mf_lock(LOCK_EX) != 0) return;
+    for (uint64_t i = 0; i < mf_hdr->cap; i++)
+        if (mf_recs[i].state == REC_USED && mf_under(mf_recs[i].path, rel)) mf_kill(&mf_recs[i]);
+    mf_unlock();
+}
+
+void manifest_move(const char *from, const char *to, int tree){
+    if (mf_lock(LOCK_EX) != 0) return;
+    if (!tree) {
+        struct manifest_rec *r = mf_slot(mf_recs, mf_hdr->cap, from, 0), m;
+        struct manifest_rec *old = mf_slot(mf_recs, mf_hdr->cap, to, 0);
+        if (old && old != r) mf_kill(old);
+        if (r) {
+            m = *r;
+            mf_kill(r);
+            if (strlen(to) < MANIFEST_PATH_MAX && mf_reserve() == 0 &&
+                (r = mf_slot(mf_recs, mf_hdr->cap, to, 1))) {
+                if (r->state == REC_DELETED) mf_hdr->deleted--;
+                mf_hdr->used++;
+                *r = m;
+                strcpy(r->path, to);
+            }
+        }
+        mf_unlock();
+        return;
+    }
+    /* Whatever was recorded at the destination was replaced. The moved
+       entries are taken out first and put back under their new names,
+       so none is met twice; those whose new path is too long are lost. */
+    size_t fl = strlen(from), tl = strlen(to), n = 0, cap = 0;
+    struct manifest_rec *moved = NULL;
+    for (uint64_t i = 0; i < mf_hdr->cap; i++) {
+        struct manifest_rec *r = &mf_recs[i];
+        if (r->state != REC_USED) continue;
+        if (*from && mf_under(r->path, from)) {
+            if (n == cap) {
+                struct manifest_rec *nm = realloc(moved, (cap = cap ? cap * 2 : 16) * sizeof(*nm));
+                if (!nm) { mf_kill(r); continue; }
+                moved = nm;
+            }
+            moved[n++] = *r;
+            mf_kill(r);
+        } else if (mf_under(r->path, to)) {
+            mf_kill(r);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct manifest_rec *m = &moved[i], *r;
+        size_t rest = strlen(m->path) - fl;
+        if (tl + rest >= MANIFEST_PATH_MAX) continue;
+        memmove(m->path + tl, m->path + fl, rest + 1);
+        memcpy(m->path, to, tl);
+        if (mf_reserve() != 0 || !(r = mf_slot(mf_recs, mf_hdr->cap, m->path, 1))) break;
+        if (r->state == REC_DELETED) mf_hdr->deleted--;
+        mf_hdr->used++;
+        *r = *m;
+    }
+    free(moved);
+    mf_unlock();
+}
+
+unsigned long long manifest_count(void){
+    if (mf_lock(LOCK_SH) != 0) return 0;
+    unsigned long long n = mf_hdr->used;
+    mf_unlock();
+    return n;
+}
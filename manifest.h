@@ -0,0 +1,48 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+#include <stdint.h>
+#include "sha256.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Paths longer than this are simply not recorded. */
+#define MANIFEST_PATH_MAX 456
+/* The manifest's name. Whatever else the server keeps in the same
+   directory (the dedup store, the du journal) is called MANIFEST_NAME
+   followed by a dot and a suffix. */
+#define MANIFEST_NAME ".manifest"
+
+struct manifest_rec {                   /* 512 bytes on disk */
+    uint64_t size;
+    int64_t mtime_ns;
+    unsigned char hash[SHA256_LEN];
+    uint32_t state;                     /* empty, used or deleted */
+    uint32_t reserved;
+    char path[MANIFEST_PATH_MAX];       /* relative to the jail root */
+};
+
+/* Memory-mapped open-addressing table of files written into the jail.
+   Entries are advisory: callers compare size and mtime with lstat
+   before trusting a hash. */
+int  manifest_open(const char *file);
+int  manifest_get(const char *rel, struct manifest_rec *out);
+int  manifest_put(const char *rel, uint64_t size, int64_t mtime_ns, const unsigned char hash[SHA256_LEN]);
+void manifest_del(const char *rel);
+/* rel and every entry below it. */
+void manifest_del_tree(const char *rel);
+/* Rekeys from as to, replacing what was recorded there; with tree set,
+   everything below from moves along (and what was below to goes). */
+void manifest_move(const char *from, const char *to, int tree);
+unsigned long long manifest_count(void);
+
+/* Those private names, once manifest_hide has been given the directory
+   holding them. Everything that shows clients directory contents (walks,
+   listings, watches, disk usage) skips the entries for which these
+   return nonzero: name is an entry of the directory dirfd, or of dir. */
+int  manifest_hide(const char *dir);
+int  manifest_hidden_at(int dirfd, const char *name);
+int  manifest_hidden(const char *dir, const char *name);
+#ifdef __cplusplus
+}
+#endif
+#endif
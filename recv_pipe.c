@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include "recv_pipe.h"
+#include "buf_pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* Filled buffers waiting for the writer; together with the one being
+   filled and the one being written this bounds a transfer's share of
+   the pool. */
+#define RECV_PIPE_DEPTH 4
+
+struct pipe_slot {
+    void *buf;
+    size_t len;
+};
+
+struct recv_pipe {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    struct pipe_slot q[RECV_PIPE_DEPTH];
+    int head, count, eof;
+    volatile int failed;
+    int fd, direct;
+    const struct recv_extent *ext; /* where the payload stream goes in the file */
+    size_t next, ei;
+    long long edone;                /* bytes of ext[ei] already written */
+    sha256_ctx *hash;
+};
+
+static int pwrite_all(struct recv_pipe *p, const char *buf, size_t len, off_t off){
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite(p->fd, buf + done, len - done, off + (off_t)done);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            /* Some filesystems accept O_DIRECT at open but not on write. */
+            if (errno == EINVAL && p->direct) {
+                p->direct = 0;
+                fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)w;
+    }
+    return 0;
+}
+
+static void *pipe_writer(void *arg){
+    struct recv_pipe *p = arg;
+    for (;;) {
+        pthread_mutex_lock(&p->mu);
+        while (p->count == 0 && !p->eof) pthread_cond_wait(&p->cv, &p->mu);
+        if (p->count == 0) { pthread_mutex_unlock(&p->mu); break; }
+        struct pipe_slot s = p->q[p->head];
+        p->head = (p->head + 1) % RECV_PIPE_DEPTH;
+        p->count--;
+        pthread_cond_broadcast(&p->cv);
+        pthread_mutex_unlock(&p->mu);
+
+        if (!p->failed) {
+            if (p->hash) sha256_update(p->hash, s.buf, s.len);
+            size_t pos = 0;
+            while (pos < s.len && p->ei < p->next && !p->failed) {
+                const struct recv_extent *e = &p->ext[p->ei];
+                size_t take = s.len - pos;
+                if ((long long)take > e->len - p->edone) take = (size_t)(e->len - p->edone);
+                size_t wlen = take;
+                if (p->direct && wlen % BUF_POOL_ALIGN) {
+                    /* Only the last buffer is short: pad it to the block
+                       size and trim the file afterwards. */
+                    size_t padded = (wlen + BUF_POOL_ALIGN - 1) / BUF_POOL_ALIGN * BUF_POOL_ALIGN;
+                    memset((char *)s.buf + pos + wlen, 0, padded - wlen);
+                    wlen = padded;
+                }
+                if (pwrite_all(p, (char *)s.buf + pos, wlen, (off_t)(e->off + p->edone)) != 0) p->failed = 1;
+                pos += take;
+                p->edone += (long long)take;
+                if (p->edone == e->len) { p->ei++; p->edone = 0; }
+            }
+        }
+        buf_pool_put(s.buf);
+    }
+    return NULL;
+}
+
+static void pipe_push(struct recv_pipe *p, void *buf, size_t len){
+    pthread_mutex_lock(&p->mu);
+    while (p->count == RECV_PIPE_DEPTH) pthread_cond_wait(&p->cv, &p->mu);
+    p->q[(p->head + p->count) % RECV_PIPE_DEPTH] = (struct pipe_slot){ buf, len };
+    p->count++;
+    pthread_cond_broadcast(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+}
+
+static int recv_pipe_run(int sock, const char *path, long long size,
+                         const struct recv_extent *ext, size_t n, int direct,
+                         struct shaper_session *shaper, sha256_ctx *hash){
+    struct recv_pipe p;
+    memset(&p, 0, sizeof(p));
+    p.hash = hash;
+    p.ext = ext;
+    p.next = n;
+    p.fd = -1;
+    long long nbytes = 0;
+    for (size_t i = 0; i < n; i++) nbytes += ext[i].len;
+    if (direct) {
+        p.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW | O_DIRECT, 0666);
+        p.direct = p.fd >= 0;
+    }
+    if (p.fd < 0) p.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0666);
+    if (p.fd < 0) p.failed = 1;
+
+    pthread_t tid;
+    pthread_mutex_init(&p.mu, NULL);
+    pthread_cond_init(&p.cv, NULL);
+    int threaded = pthread_create(&tid, NULL, pipe_writer, &p) == 0;
+    if (!threaded) p.failed = 1;
+
+    size_t bufsize = buf_pool_bufsize();
+    long long left = nbytes;
+    int net_err = 0;
+    while (left > 0 && !net_err) {
+        char *buf = buf_pool_get();
+        size_t fill = 0;
+        while (fill < bufsize && left > 0) {
+            size_t want = (left > (long long)(bufsize - fill)) ? bufsize - fill : (size_t)left;
+            ssize_t r = recv(sock, buf + fill, want, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { net_err = 1; break; }
+            if (shaper) shaper_take(shaper, (size_t)r);
+            fill += (size_t)r;
+            left -= r;
+        }
+        /* After a write error keep reading, but drop the data. */
+        if (fill && threaded && !p.failed) pipe_push(&p, buf, fill);
+        else buf_pool_put(buf);
+    }
+
+    if (threaded) {
+        pthread_mutex_lock(&p.mu);
+        p.eof = 1;
+        pthread_cond_broadcast(&p.cv);
+        pthread_mutex_unlock(&p.mu);
+        pthread_join(tid, NULL);
+    }
+    pthread_cond_destroy(&p.cv);
+    pthread_mutex_destroy(&p.mu);
+    if (p.fd >= 0) {
+        if (!p.failed && ftruncate(p.fd, (off_t)size) != 0) p.failed = 1;
+        if (close(p.fd) != 0) p.failed = 1;
+    }
+    return (net_err || p.failed) ? -1 : 0;
+}
+
+int recv_pipe_to_file(int sock, const char *path, long long nbytes, int direct,
+                      struct shaper_session *shaper, sha256_ctx *hash){
+    struct recv_extent all = { 0, nbytes };
+    return recv_pipe_run(sock, path, nbytes, &all, nbytes > 0, direct, shaper, hash);
+}
+
+/* Extents start wherever the sender's filesystem put them, so O_DIRECT
+   alignment cannot be promised: sparse files go through the page cache. */
+int recv_pipe_to_file_sparse(int sock, const char *path, long long size,
+                             const struct recv_extent *ext, size_t n,
+                             struct shaper_session *shaper){
+    return recv_pipe_run(sock, path, size, ext, n, 0, shaper, NULL);
+}
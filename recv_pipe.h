@@ -0,0 +1,29 @@
+#ifndef RECV_PIPE_H
+#define RECV_PIPE_H
+#include "sha256.h"
+#include "shaper.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Receives exactly nbytes from sock into path. A network stage fills
+   pool buffers while a writer thread hashes and writes them, so socket
+   and disk I/O overlap. With direct set the file is written with
+   O_DIRECT where the filesystem allows it. On a write error the
+   remaining payload is still drained so the command stream stays in
+   step. */
+int recv_pipe_to_file(int sock, const char *path, long long nbytes, int direct,
+                      struct shaper_session *shaper, sha256_ctx *hash);
+
+/* Sparse variant: the payload is the concatenation of the listed data
+   extents (sorted, non-overlapping, inside size). Everything between
+   them is left as holes in the new file, which is then cut to size. */
+struct recv_extent {
+    long long off, len;
+};
+int recv_pipe_to_file_sparse(int sock, const char *path, long long size,
+                             const struct recv_extent *ext, size_t n,
+                             struct shaper_session *shaper);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -13,44 +13,219 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "delete_directory.h"
+#include "copy_tree.h"
+#include "find_tree.h"
+#include "du_index.h"
+#include "manifest.h"
+#include "sha256.h"
+#include "shaper.h"
+#include "buf_pool.h"
+#include "recv_pipe.h"
+#include "arena.h"
+#include "watch.h"
+#include "supervisor.h"
+#include "cas.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
+#define CAS_DIR_NAME MANIFEST_NAME ".cas"
+#define DU_JOURNAL_NAME MANIFEST_NAME ".du"
+#define IO_BUF_SIZE (1 << 20)
+#define IO_BUF_COUNT 16
+#define CMD_LINE_MAX 2048
+#define SPARSE_MAX_EXTENTS 65536
+#define SESSION_THREADS_MAX 512     /* commands a worker runs at once */
+#define SESSION_THREADS_KEEP 4      /* idle threads kept past SESSION_THREAD_IDLE */
+#define SESSION_THREAD_IDLE 30      /* seconds */
+#define LISTEN_BACKLOG 128          /* a burst of connects is queued, not dropped */
 
 static char BASE_DIR[PATH_MAX] = {0};
 static char START_DIR[PATH_MAX] = {0};
+static int ROOT_FD = -1;            /* BASE_DIR, shared by sessions at the top */
+static long long DIRECT_MIN = 0;    /* uploads this large use O_DIRECT; 0: never */
+static mode_t UMASK = 022;          /* the process umask, read once at startup */
+
+/* Everything a connection keeps between commands. Path and line buffers
+   come from the arena, which is reset after every command; transfer
+   buffers are borrowed from buf_pool only while a payload is moving.
+   Both are shared by all sessions of a worker. An idle session is just
+   this struct and its socket in the worker's epoll set; a thread is
+   only attached while it has a command (or events) to deal with. */
+struct session {
+    int fd;
+    int cwd_fd;                     /* the session's working directory; -1: the jail root */
+    struct shaper_session shaper;
+    struct arena arena;
+    struct watch_set *watch;        /* ssub subscription, if any */
+    int admin;                      /* connected over loopback: may retune shared rates */
+    /* Owned by the worker loop, under sv_mu. */
+    int busy;                       /* queued or being served */
+    int again;                      /* woken again while busy */
+    struct session *next_run;       /* run queue */
+    struct session *prev, *next;    /* every open session */
+};
+static __thread struct session *SESSION;    /* the session whose command is running */
+
+static void *req_alloc(size_t n) {
+    return arena_alloc(&SESSION->arena, n);
+}
 
 static int starts_with(const char* s, const char* p) {
     return strncmp(s, p, strlen(p)) == 0;
 }
 
+/* Path of a canonical in-jail path relative to BASE_DIR ("" for the root). */
+static const char *jail_rel(const char *canon) {
+    const char *rel = canon + strlen(BASE_DIR);
+    return *rel == '/' ? rel + 1 : rel;
+}
+
+/* Whether rel, below the jail root, is one of the entries the server
+   keeps for itself (the manifest, the dedup store, the du journal) or
+   lies inside one. */
+static int is_manifest_rel(const char *rel) {
+    size_t n = strcspn(rel, "/");
+    char *first = req_alloc(n + 1);
+    memcpy(first, rel, n);
+    first[n] = '\0';
+    return manifest_hidden(BASE_DIR, first);
+}
+
+/* Server-private entries (the manifest, the dedup store) count as
+   outside the jail. */
 static int secure_path_in_base(const char* path) {
-    char canon[PATH_MAX];
+    char *canon = req_alloc(PATH_MAX);
     if (!realpath(path, canon)) return 0;
     size_t b = strlen(BASE_DIR);
-    return (strncmp(canon, BASE_DIR, b) == 0) && (canon[b] == '/' || canon[b] == '\0');
+    return (strncmp(canon, BASE_DIR, b) == 0) && (canon[b] == '/' || canon[b] == '\0') &&
+           !is_manifest_rel(jail_rel(canon));
 }
 
-static int secure_cd(const char *target) {
-    if (!target || !*target) return -1;
-    char tmp[PATH_MAX];
+/* For paths that may not exist yet: the parent must resolve inside the
+   jail and the last component must be a plain name. */
+static int secure_new_path_in_base(const char *path, char *out, size_t outsz) {
+    char *parent = req_alloc(PATH_MAX), *canon = req_alloc(PATH_MAX);
+    strncpy(parent, path, PATH_MAX-1);
+    parent[PATH_MAX-1] = '\0';
+    size_t len = strlen(parent);
+    while (len > 1 && parent[len-1] == '/') parent[--len] = '\0';
+    char *slash = strrchr(parent, '/');
+    const char *base;
+    if (!slash) { base = path; strcpy(parent, "."); }
+    else {
+        base = path + (slash - parent) + 1;
+        if (slash == parent) parent[1] = '\0'; else *slash = '\0';
+    }
+    char name[NAME_MAX+1];
+    size_t bl = strcspn(base, "/");
+    if (bl == 0 || bl > NAME_MAX) return 0;
+    memcpy(name, base, bl); name[bl] = '\0';
+    if (!strcmp(name, ".") || !strcmp(name, "..")) return 0;
+    if (!realpath(parent, canon) || !secure_path_in_base(canon)) return 0;
+    struct stat st;
+    /* The last component is used as is; a symlink there could lead out. */
+    return snprintf(out, outsz, "%s/%s", strcmp(canon, "/") ? canon : "", name) < (int)outsz &&
+           !is_manifest_rel(jail_rel(out)) && !(lstat(out, &st) == 0 && S_ISLNK(st.st_mode));
+}
+
+static int worker_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (n > 8 ? 8 : (int)n);
+}
+
+/* Records a finished upload so that ssync can trust its hash. */
+static void manifest_record(const char *canon, const unsigned char hash[SHA256_LEN]) {
+    struct stat st;
+    if (lstat(canon, &st) != 0 || !S_ISREG(st.st_mode)) return;
+    manifest_put(jail_rel(canon), (uint64_t)st.st_size,
+                 (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, hash);
+}
+
+/* Hash of an in-jail file: the manifest's if size and mtime still match,
+   otherwise computed now and recorded. */
+static int manifest_hash(const char *canon, const struct stat *st, unsigned char hash[SHA256_LEN]) {
+    struct manifest_rec r;
+    int64_t mt = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    if (manifest_get(jail_rel(canon), &r) == 0 && r.size == (uint64_t)st->st_size && r.mtime_ns == mt) {
+        memcpy(hash, r.hash, SHA256_LEN);
+        return 0;
+    }
+    if (sha256_file(canon, hash) != 0) return -1;
+    manifest_record(canon, hash);
+    return 0;
+}
+
+/* An empty file next to canon for an upload to fill, named like
+   copy_tree's temporaries. It gets the mode of the file it will replace,
+   or the one a new file would get. Returns its path (arena memory). */
+static char *upload_temp(const char *canon, const struct stat *replacing) {
+    const char *slash = strrchr(canon, '/');
+    char *tmp = req_alloc(PATH_MAX + 16);
+    snprintf(tmp, PATH_MAX + 16, "%.*s/.%.*s.XXXXXX", (int)(slash - canon), canon, NAME_MAX - 8, slash + 1);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) return NULL;
+    mode_t mode = replacing && S_ISREG(replacing->st_mode) ? replacing->st_mode & 07777 : 0666 & ~UMASK;
+    int ok = fchmod(fd, mode) == 0;
+    close(fd);
+    if (!ok) { unlink(tmp); return NULL; }
+    return tmp;
+}
+
+/* Places a dedup hit at canon and records it like a finished upload. */
+static int place_from_store(const char *canon, const unsigned char hash[SHA256_LEN], long long size) {
+    struct stat before, after;
+    int existed = lstat(canon, &before) == 0;
+    if (existed && !S_ISREG(before.st_mode)) return -1;
+    unsigned epoch = du_index_epoch();
+    if (cas_place(hash, (uint64_t)size, canon) != 0) return -1;
+    if (lstat(canon, &after) == 0)
+        du_index_file(canon, existed ? &before : NULL, &after, epoch);
+    manifest_record(canon, hash);
+    return 0;
+}
+
+/* Client paths starting with '/' are relative to the jail root, others
+   to the session's directory. Returns the canonical path (arena memory)
+   or NULL if it does not resolve inside the jail. */
+static char *jail_resolve(const char *target) {
+    if (!target || !*target) return NULL;
+    char *tmp = req_alloc(PATH_MAX);
     if (target[0] == '/') {
-        snprintf(tmp, sizeof(tmp), "%s%s", BASE_DIR, target);
+        snprintf(tmp, PATH_MAX, "%s%s", BASE_DIR, target);
     } else {
-        if (!getcwd(tmp, sizeof(tmp))) return -1;
+        if (!getcwd(tmp, PATH_MAX)) return NULL;
         size_t len = strlen(tmp);
-        if (len + 1 < sizeof(tmp)) {
+        if (len + 1 < PATH_MAX) {
             tmp[len] = '/';
             tmp[len+1] = '\0';
         }
-        strncat(tmp, target, sizeof(tmp) - strlen(tmp) - 1);
+        strncat(tmp, target, PATH_MAX - strlen(tmp) - 1);
     }
-    char canon[PATH_MAX];
-    if (!realpath(tmp, canon)) return -1;
-    if (!secure_path_in_base(canon)) return -1;
-    if (chdir(canon) != 0) return -1;
+    char *canon = req_alloc(PATH_MAX);
+    if (!realpath(tmp, canon)) return NULL;
+    if (!secure_path_in_base(canon)) return NULL;
+    return canon;
+}
+
+static int secure_cd(const char *target) {
+    char *canon = jail_resolve(target);
+    if (!canon) return -1;
+    int fd = open(canon, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fchdir(fd) != 0) { close(fd); return -1; }
+    if (SESSION->cwd_fd >= 0) close(SESSION->cwd_fd);
+    /* Back at the top the session needs no descriptor of its own. */
+    if (strcmp(canon, BASE_DIR) == 0) { close(fd); fd = -1; }
+    SESSION->cwd_fd = fd;
     return 0;
 }
 
@@ -58,33 +233,53 @@ static void send_str(int c, const char* s) {
     send(c, s, strlen(s), 0);
 }
 
+/* Peeks at what has arrived and consumes only up to the newline, so a
+   line costs two syscalls instead of one per byte and nothing after it
+   (a payload, the next command) is taken off the socket. */
 static int recv_line(int c, char *buf, size_t bufsz){
     size_t u = 0;
     while (u + 1 < bufsz) {
-        char ch; ssize_t r = recv(c, &ch, 1, 0);
-        if (r <= 0) return -1;           
-        if (ch == '\n') { buf[u] = '\0'; return (int)u; }
-        if (ch != '\r') buf[u++] = ch;   
+        char peek[1024];
+        size_t room = bufsz - 1 - u;
+        if (room > sizeof(peek)) room = sizeof(peek);
+        ssize_t r = recv(c, peek, room, MSG_PEEK);
+        if (r <= 0) return -1;
+        char *nl = memchr(peek, '\n', (size_t)r);
+        size_t take = nl ? (size_t)(nl - peek) + 1 : (size_t)r;
+        if (recv(c, peek, take, 0) != (ssize_t)take) return -1;
+        for (size_t i = 0; i < take; i++) {
+            if (peek[i] == '\n') { buf[u] = '\0'; return (int)u; }
+            if (peek[i] != '\r') buf[u++] = peek[i];
+        }
     }
     buf[bufsz-1] = '\0';
     return (int)u;
 }
 
-static int recv_n_to_file(int c, const char* fname, long long nbytes){
-    FILE *fp = fopen(fname, "wb");
-    if (!fp) return -1;
-    char buf[4096];
-    long long left = nbytes;
-    while (left > 0){
-        ssize_t r = recv(c, buf, (left > (long long)sizeof(buf)) ? sizeof(buf) : (size_t)left, 0);
-        if (r <= 0){ fclose(fp); return -1; }
-        if (fwrite(buf,1,(size_t)r,fp)!=(size_t)r){ fclose(fp); return -1; }
-        left -= r;
+static int send_all(int c, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(c, buf, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w;
+        n -= (size_t)w;
     }
-    fclose(fp);
     return 0;
 }
 
+/* Discards a payload we refused, keeping the command stream in step. */
+static void drain_n(int c, long long nbytes){
+    if (nbytes <= 0) return;
+    char *buf = buf_pool_get();
+    size_t bufsz = buf_pool_bufsize();
+    while (nbytes > 0){
+        ssize_t r = recv(c, buf, (nbytes > (long long)bufsz) ? bufsz : (size_t)nbytes, 0);
+        if (r <= 0) break;
+        shaper_take(&SESSION->shaper, (size_t)r);
+        nbytes -= r;
+    }
+    buf_pool_put(buf);
+}
 
 static int recv_until_eof_to_file(int c, const char* fname) {
     FILE *fp = fopen(fname, "wb");
@@ -105,10 +300,680 @@ static int recv_until_eof_to_file(int c, const char* fname) {
     return 0;
 }
 
+/* "10", "+4k", "-2M": find(1)-style comparison prefix plus an optional
+   k/M/G suffix. Returns the comparison sign (-1, 0, +1) or -2 on error. */
+static int parse_cmp_number(const char *s, long long unit, long long *out) {
+    int sign = 0;
+    if (*s == '+') { sign = 1; s++; } else if (*s == '-') { sign = -1; s++; }
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || v < 0) return -2;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'M': v <<= 20; end++; break;
+        case 'G': v <<= 30; end++; break;
+    }
+    if (*end) return -2;
+    *out = v * unit;
+    return sign;
+}
+
+struct sfind_state {
+    int client;
+    const char *prefix;
+    char *buf;                      /* result line, from the request arena */
+    size_t bufsz;
+};
+
+static int sfind_match(void *user, const char *rel, const struct stat *st) {
+    (void)st;
+    struct sfind_state *fs = user;
+    int n = snprintf(fs->buf, fs->bufsz, "%s%s%s\n", fs->prefix, *fs->prefix ? "/" : "", rel);
+    if (n <= 0 || n >= (int)fs->bufsz) return 0;
+    return send(fs->client, fs->buf, (size_t)n, MSG_NOSIGNAL) == n ? 0 : -1;
+}
+
+/* Any input from the client while results are streaming cancels the
+   search. The input is left unread; "scancel" is then swallowed by
+   handle_command. */
+static int sfind_cancelled(void *user) {
+    struct sfind_state *fs = user;
+    char peek;
+    ssize_t r = recv(fs->client, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r < 0) return errno != EAGAIN && errno != EWOULDBLOCK;
+    return 1;
+}
+
+static void handle_sfind(int client, char *args) {
+    struct find_query q = { .min_size = -1, .max_size = -1 };
+    const char *start = NULL;
+    time_t now = time(NULL);
+    char *save;
+    char *tok = strtok_r(args, " \t\r\n", &save);
+    for (; tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        char *val = NULL;
+        if (tok[0] == '-' && strcmp(tok, "-") != 0) {
+            val = strtok_r(NULL, " \t\r\n", &save);
+            if (!val) { send_str(client, "sfind: missing value\n"); return; }
+        }
+        long long v;
+        int sign;
+        if (!val) {
+            if (start) { send_str(client, "sfind: too many paths\n"); return; }
+            start = tok;
+        } else if (!strcmp(tok, "-name")) {
+            q.name_glob = val;
+        } else if (!strcmp(tok, "-size")) {
+            if ((sign = parse_cmp_number(val, 1, &v)) == -2) { send_str(client, "sfind: bad size\n"); return; }
+            if (sign >= 0) q.min_size = v + (sign > 0);
+            if (sign <= 0) q.max_size = sign < 0 ? v - 1 : v;
+        } else if (!strcmp(tok, "-mtime")) {
+            if ((sign = parse_cmp_number(val, 86400, &v)) == -2) { send_str(client, "sfind: bad mtime\n"); return; }
+            if (sign > 0) q.older_than = now - v;
+            else if (sign < 0) q.newer_than = now - v;
+            else { q.older_than = now - v; q.newer_than = now - v - 86400; }
+        } else if (!strcmp(tok, "-limit")) {
+            if (parse_cmp_number(val, 1, &v) != 0) { send_str(client, "sfind: bad limit\n"); return; }
+            q.limit = (unsigned long)v;
+        } else {
+            send_str(client, "sfind: unknown option\n");
+            return;
+        }
+    }
+    char *canon = req_alloc(PATH_MAX);
+    if (!realpath(start ? start : ".", canon) || !secure_path_in_base(canon)) {
+        send_str(client, "sfind: bad path\n");
+        return;
+    }
+    int dfd = open(canon, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) { send_str(client, "sfind: cannot open directory\n"); return; }
+    q.workers = worker_count();
+
+    struct sfind_state fs = { client, start ? start : "", req_alloc(PATH_MAX * 2), PATH_MAX * 2 };
+    unsigned long n = 0;
+    int rc = find_tree(dfd, &q, sfind_match, sfind_cancelled, &fs, &n);
+    close(dfd);
+    if (rc < 0) dprintf(client, "END %lu error\n", n);
+    else if (rc == FIND_LIMIT) dprintf(client, "END %lu limit\n", n);
+    else if (rc == FIND_CANCELLED) dprintf(client, "END %lu cancelled\n", n);
+    else dprintf(client, "END %lu\n", n);
+}
+
+static void handle_sdu(int client, const char *arg) {
+    char *canon = req_alloc(PATH_MAX);
+    struct stat st;
+    if (!realpath(*arg ? arg : ".", canon) || !secure_path_in_base(canon) || stat(canon, &st) != 0) {
+        send_str(client, "sdu: bad path\n");
+        return;
+    }
+    struct du_totals t = {0};
+    const char *src = "";
+    if (!S_ISDIR(st.st_mode)) {
+        t.bytes = (unsigned long long)st.st_size;
+        t.alloc = (unsigned long long)st.st_blocks * 512ULL;
+        t.files = S_ISREG(st.st_mode);
+    } else if (du_index_query(canon, &t) != 0) {
+        /* Index still building: walk the tree directly. */
+        if (du_scan(canon, &t, worker_count()) != 0) { send_str(client, "sdu: scan failed\n"); return; }
+        src = " (scanned)";
+    }
+    dprintf(client, "%llu bytes (%llu allocated), %llu files, %llu dirs%s\n",
+            t.bytes, t.alloc, t.files, t.dirs, src);
+}
+
+/* slist [-t mtime_ns] [path]: one "<type> <size> <name>" line per entry
+   (type d, f, l or o) followed by "END <count> <mtime_ns>", the mtime
+   of the directory. The path is the rest of the line, spaces included.
+   A client passing the mtime of the listing it holds with -t gets
+   "SAME <mtime_ns>" alone if the directory has not changed since.
+   A directory modified within the last two seconds reports mtime 0:
+   timestamps are coarse, so a later change could leave it unchanged. */
+static void handle_slist(int client, char *args) {
+    long long since = 0;
+    char *path = args + strspn(args, " \t");
+    if (strncmp(path, "-t ", 3) == 0) {
+        since = strtoll(path + 3, &path, 10);
+        path += strspn(path, " \t");
+    }
+    char *canon = jail_resolve(*path ? path : ".");
+    int dfd = canon ? open(canon, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    struct stat dst;
+    if (dfd < 0 || fstat(dfd, &dst) != 0) {
+        send_str(client, "ERR bad path\n");
+        if (dfd >= 0) close(dfd);
+        return;
+    }
+    long long mt = (long long)dst.st_mtim.tv_sec * 1000000000LL + dst.st_mtim.tv_nsec;
+    if (dst.st_mtim.tv_sec + 2 > time(NULL)) mt = 0;
+    if (since && mt != 0 && since == mt) {
+        dprintf(client, "SAME %lld\n", mt);
+        close(dfd);
+        return;
+    }
+    DIR *d = fdopendir(dfd);
+    if (!d) { close(dfd); send_str(client, "ERR cannot open directory\n"); return; }
+    size_t bufsz = 64 * 1024, used = 0;
+    char *buf = req_alloc(bufsz);
+    unsigned long count = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        if (manifest_hidden_at(dirfd(d), e->d_name)) continue;
+        struct stat st;
+        char type = 'o';
+        long long size = 0;
+        if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? 'd' : S_ISREG(st.st_mode) ? 'f' : S_ISLNK(st.st_mode) ? 'l' : 'o';
+            size = (long long)st.st_size;
+        }
+        if (bufsz - used < NAME_MAX + 64) {
+            if (send_all(client, buf, used) != 0) { closedir(d); return; }
+            used = 0;
+        }
+        used += (size_t)snprintf(buf + used, bufsz - used, "%c %lld %s\n", type, size, e->d_name);
+        count++;
+    }
+    closedir(d);
+    used += (size_t)snprintf(buf + used, bufsz - used, "END %lu %lld\n", count, mt);
+    send_all(client, buf, used);
+}
+
+/* ssub [-r] [path]: push change events for path (the rest of the line;
+   default: the session's directory), or for its whole subtree with -r, until sunsub or a new
+   ssub. Events are coalesced for a moment and only sent between
+   commands, never inside a reply; see watch.h for the line format. */
+static void handle_ssub(int client, char *args) {
+    int recursive = 0;
+    const char *path = args + strspn(args, " \t");
+    if (!strcmp(path, "-r") || !strncmp(path, "-r ", 3)) {
+        recursive = 1;
+        path += 2;
+        path += strspn(path, " \t");
+    }
+    char *canon = jail_resolve(*path ? path : ".");
+    struct stat st;
+    if (!canon || stat(canon, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        send_str(client, "ssub: bad path\n");
+        return;
+    }
+    const char *rel = jail_rel(canon);
+    char *prefix = req_alloc(PATH_MAX);
+    snprintf(prefix, PATH_MAX, "%s%s", *rel ? "/" : "", rel);
+    watch_close(SESSION->watch);
+    SESSION->watch = watch_open(canon, prefix, recursive);
+    if (!SESSION->watch) {
+        send_str(client, errno == ENOSPC ? "ssub: too many directories\n" : "ssub: cannot watch\n");
+        return;
+    }
+    dprintf(client, "Subscribed %s (%u dirs)\n", *prefix ? prefix : "/", watch_dirs(SESSION->watch));
+}
+
+/* ---- metadata operations, shared by the single commands and sbatch ---- */
+/* Like an upload target, the new directory must resolve inside the jail
+   and must not take one of the server's private names. */
+static int op_mkdir(const char *name) {
+    char *canon = req_alloc(PATH_MAX);
+    if (!secure_new_path_in_base(name, canon, PATH_MAX) || mkdir(canon, 0777) != 0) return -1;
+    du_index_add_tree(canon);
+    return 0;
+}
+
+static int op_rm(const char *path) {
+    char *canon = req_alloc(PATH_MAX);
+    if (!realpath(path, canon) || !secure_path_in_base(canon)) return -1;
+    struct stat st;
+    int is_dir = lstat(canon, &st) == 0 && S_ISDIR(st.st_mode);
+    unsigned epoch = du_index_epoch();
+    int rc = delete_directory(canon);
+    if (is_dir) {
+        if (rc == 0) du_index_remove_tree(canon);
+        else du_index_add_tree(canon);
+        /* A partly deleted tree loses its entries too: they are only
+           hints, and the files left are hashed again when needed. */
+        manifest_del_tree(jail_rel(canon));
+    } else if (rc == 0) {
+        du_index_file(canon, &st, NULL, epoch);
+        manifest_del(jail_rel(canon));
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+/* Returns -2 for a malformed argument list. */
+static int op_rename(const char *args) {
+    char *tmp = arena_strdup(&SESSION->arena, args);
+    char *save;
+    char *oldn = strtok_r(tmp, " \t\r\n", &save);
+    char *newn = strtok_r(NULL, " \t\r\n", &save);
+    if (!oldn || !newn) return -2;
+    char *c1 = req_alloc(PATH_MAX), *c2 = req_alloc(PATH_MAX);
+    struct stat s1, s2;
+    unsigned epoch = du_index_epoch();
+    if (!realpath(oldn, c1) || !realpath(newn, c2) ||
+        !secure_path_in_base(c1) || !secure_path_in_base(c2) ||
+        lstat(c1, &s1) != 0 || lstat(c2, &s2) != 0 ||
+        rename(c1, c2) != 0) return -1;
+    manifest_move(jail_rel(c1), jail_rel(c2), S_ISDIR(s1.st_mode));
+    if (S_ISDIR(s1.st_mode)) du_index_move_tree(c1, c2);
+    else {
+        du_index_file(c2, &s2, &s1, epoch);
+        du_index_file(c1, &s1, NULL, epoch);
+    }
+    return 0;
+}
+
+/* Returns -2 for a malformed argument list. */
+static int op_copy(const char *args) {
+    char *tmp = arena_strdup(&SESSION->arena, args);
+    char *save;
+    char *src = strtok_r(tmp, " \t\r\n", &save);
+    char *dst = strtok_r(NULL, " \t\r\n", &save);
+    if (!src || !dst) return -2;
+    char *c1 = req_alloc(PATH_MAX), *c2 = req_alloc(PATH_MAX), *c3 = req_alloc(PATH_MAX);
+    struct stat st;
+    if (!realpath(src, c1) || !secure_path_in_base(c1)) return -1;
+    /* Like cp: copying onto an existing directory copies into it. */
+    if (stat(dst, &st) == 0 && S_ISDIR(st.st_mode)) {
+        const char *b = strrchr(c1, '/');
+        snprintf(c3, PATH_MAX, "%s/%s", dst, b ? b + 1 : c1);
+        dst = c3;
+    }
+    if (!secure_new_path_in_base(dst, c2, PATH_MAX)) return -1;
+    struct stat before, after;
+    int existed = lstat(c2, &before) == 0;
+    /* Another link of the source, such as a second copy placed from the
+       dedup store, already holds its data. */
+    if (existed && S_ISREG(before.st_mode) && strcmp(c1, c2) != 0 && stat(c1, &st) == 0 &&
+        st.st_ino == before.st_ino && st.st_dev == before.st_dev) return 0;
+    struct copy_opts o = { .workers = 1, .jail = BASE_DIR };
+    unsigned epoch = du_index_epoch();
+    int rc = copy_tree_ex(c1, c2, &o);
+    if (lstat(c2, &after) == 0) {
+        if (S_ISDIR(after.st_mode)) du_index_add_tree(c2);
+        else du_index_file(c2, existed ? &before : NULL, &after, epoch);
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+static int batch_op(const char *line) {
+    if (strncmp(line, "smkdir ", 7) == 0) return op_mkdir(line + 7);
+    if (strncmp(line, "srm ", 4) == 0) return op_rm(line + 4);
+    if (strncmp(line, "srename ", 8) == 0) return op_rename(line + 8);
+    if (strncmp(line, "scopy ", 6) == 0) return op_copy(line + 6);
+    return -1;
+}
+
+/* sbatch <count> [stop]: the next <count> lines are smkdir / srm /
+   srename / scopy commands, run in order. The single reply is
+   "BATCH <ok> <failed> <vector>" with one character per operation:
+   '0' done, '1' failed, '-' skipped after a failure when stop is given. */
+static void handle_sbatch(int client, const char *args) {
+    long count = -1;
+    char opt[16] = "";
+    if (sscanf(args, "%ld %15s", &count, opt) < 1 || count < 0 || count > 1000000 ||
+        (*opt && strcmp(opt, "stop") != 0)) {
+        send_str(client, "sbatch: bad arguments\n");
+        return;
+    }
+    int stop_on_error = *opt != '\0';
+    char *vec = malloc((size_t)count + 1);
+    size_t linesz = PATH_MAX * 2 + 16;
+    char *line = req_alloc(linesz);
+    struct arena_mark mark = arena_save(&SESSION->arena);
+    long ok = 0, failed = 0;
+    int stopped = 0;
+    for (long i = 0; i < count; i++) {
+        /* Every line is read even after a stop so the stream stays in step. */
+        if (recv_line(client, line, linesz) < 0) { free(vec); return; }
+        if (!vec) continue;
+        if (stopped) { vec[i] = '-'; continue; }
+        if (batch_op(line) == 0) { vec[i] = '0'; ok++; }
+        else {
+            vec[i] = '1'; failed++;
+            stopped = stop_on_error;
+        }
+        arena_restore(&SESSION->arena, mark);
+    }
+    if (!vec) { send_str(client, "sbatch: out of memory\n"); return; }
+    vec[count] = '\0';
+    dprintf(client, "BATCH %ld %ld %s\n", ok, failed, vec);
+    free(vec);
+}
+
+struct sync_ent {
+    char *path;
+    long long size;
+    unsigned char hash[SHA256_LEN];
+};
+
+static int sync_ent_cmp(const void *a, const void *b) {
+    return strcmp(((const struct sync_ent *)a)->path, ((const struct sync_ent *)b)->path);
+}
+
+struct sync_list {
+    struct sync_ent *v;
+    size_t n, cap;
+    int skip_manifest;
+};
+
+static int sync_list_add(struct sync_list *l, const char *path, long long size) {
+    if (l->n == l->cap) {
+        size_t ncap = l->cap ? l->cap * 2 : 256;
+        struct sync_ent *nv = realloc(l->v, ncap * sizeof(*nv));
+        if (!nv) return -1;
+        l->v = nv;
+        l->cap = ncap;
+    }
+    struct sync_ent *e = &l->v[l->n];
+    if (!(e->path = strdup(path))) return -1;
+    e->size = size;
+    l->n++;
+    return 0;
+}
+
+static void sync_list_free(struct sync_list *l) {
+    for (size_t i = 0; i < l->n; i++) free(l->v[i].path);
+    free(l->v);
+}
+
+static int sync_collect(void *user, const char *rel, const struct stat *st) {
+    struct sync_list *l = user;
+    if (!st || !S_ISREG(st->st_mode)) return 0;
+    if (l->skip_manifest && is_manifest_rel(rel)) return 0;
+    return sync_list_add(l, rel, (long long)st->st_size);
+}
+
+static int safe_rel_path(const char *p) {
+    if (!*p || *p == '/') return 0;
+    for (const char *s = p; *s; ) {
+        size_t n = strcspn(s, "/");
+        if (n == 0 || (n == 1 && s[0] == '.') || (n == 2 && s[0] == '.' && s[1] == '.')) return 0;
+        s += n;
+        if (*s) s++;
+    }
+    return 1;
+}
+
+/* ssync <count> [dir]: the client sends <count> lines of
+   "<size> <sha256> <path>" (paths relative to dir, default "."). The
+   sorted client list is merged against a walk of the server tree in one
+   pass; the reply lists "SEND <path>" and "DELETE <path>" lines and ends
+   with "END <sends> <deletes>". */
+static void handle_ssync(int client, const char *args) {
+    long long count = -1;
+    char *dir = req_alloc(PATH_MAX);
+    strcpy(dir, ".");
+    if (sscanf(args, "%lld %4095s", &count, dir) < 1 || count < 0) {
+        send_str(client, "ssync: bad count\n");
+        return;
+    }
+    struct sync_list cl = {0}, sl = {0};
+    size_t linesz = PATH_MAX + 128;
+    char *line = req_alloc(linesz);
+    int bad = 0;
+    for (long long i = 0; i < count; i++) {
+        if (recv_line(client, line, linesz) < 0) { sync_list_free(&cl); return; }
+        long long size;
+        char hex[SHA256_LEN * 2 + 1];
+        int off = 0;
+        if (bad || sscanf(line, "%lld %64s %n", &size, hex, &off) != 2 || !off ||
+            !safe_rel_path(line + off) || sync_list_add(&cl, line + off, size) != 0 ||
+            sha256_unhex(hex, cl.v[cl.n - 1].hash) != 0) {
+            bad = 1;
+        }
+    }
+    char *root = req_alloc(PATH_MAX);
+    int dfd = -1;
+    if (bad || !realpath(dir, root) || !secure_path_in_base(root) ||
+        (dfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        send_str(client, bad ? "ssync: bad manifest\n" : "ssync: bad path\n");
+        sync_list_free(&cl);
+        return;
+    }
+    struct find_query q = { .min_size = -1, .max_size = -1, .want_stat = 1, .workers = worker_count() };
+    sl.skip_manifest = strcmp(root, BASE_DIR) == 0;
+    int rc = find_tree(dfd, &q, sync_collect, NULL, &sl, NULL);
+    close(dfd);
+    if (rc != 0) {
+        send_str(client, "ssync: scan failed\n");
+        sync_list_free(&cl);
+        sync_list_free(&sl);
+        return;
+    }
+    qsort(cl.v, cl.n, sizeof(*cl.v), sync_ent_cmp);
+    qsort(sl.v, sl.n, sizeof(*sl.v), sync_ent_cmp);
+
+    unsigned long sends = 0, deletes = 0;
+    size_t i = 0, j = 0;
+    char *canon = req_alloc(PATH_MAX * 2);
+    while (i < cl.n || j < sl.n) {
+        int c = i >= cl.n ? 1 : j >= sl.n ? -1 : strcmp(cl.v[i].path, sl.v[j].path);
+        if (c < 0) {
+            dprintf(client, "SEND %s\n", cl.v[i++].path);
+            sends++;
+        } else if (c > 0) {
+            dprintf(client, "DELETE %s\n", sl.v[j++].path);
+            deletes++;
+        } else {
+            int same = cl.v[i].size == sl.v[j].size;
+            if (same) {
+                struct stat st;
+                unsigned char h[SHA256_LEN];
+                snprintf(canon, PATH_MAX * 2, "%s/%s", root, sl.v[j].path);
+                same = lstat(canon, &st) == 0 && manifest_hash(canon, &st, h) == 0 &&
+                       memcmp(h, cl.v[i].hash, SHA256_LEN) == 0;
+            }
+            if (!same) { dprintf(client, "SEND %s\n", cl.v[i].path); sends++; }
+            i++; j++;
+        }
+    }
+    dprintf(client, "END %lu %lu\n", sends, deletes);
+    sync_list_free(&cl);
+    sync_list_free(&sl);
+}
+
+/* srate global|session|default <bytes/s, k/M/G suffix, 0 = unlimited>.
+   The global and default rates are shared by every client, so only a
+   loopback session may set them; others may only slow their own session
+   further. */
+static void handle_srate(int client, const char *args) {
+    char which[16], val[32];
+    long long rate;
+    if (sscanf(args, "%15s %31s", which, val) != 2 || parse_cmp_number(val, 1, &rate) != 0) {
+        send_str(client, "usage: srate global|session|default <rate>\n");
+        return;
+    }
+    long long cur = SESSION->shaper.bucket.rate;
+    int lowers = rate > 0 && (cur <= 0 || rate <= cur);
+    if (!SESSION->admin && (strcmp(which, "session") != 0 || !lowers)) {
+        send_str(client, "srate: not permitted\n");
+        return;
+    }
+    if (!strcmp(which, "global")) shaper_set_global(rate);
+    else if (!strcmp(which, "session")) shaper_set_session(&SESSION->shaper, rate);
+    else if (!strcmp(which, "default")) shaper_set_default(rate);
+    else { send_str(client, "usage: srate global|session|default <rate>\n"); return; }
+    send_str(client, "Rate set\n");
+}
+
+static void sv_get_stats(unsigned *sessions, int *threads, int *idle);
+
+/* Pool, arena and session figures are this worker's, shared by all of
+   its sessions; rates and dedup counters are server-wide. */
+static void handle_sstat(int client) {
+    char *buf = req_alloc(1024);
+    shaper_format_stats(buf, 1024, &SESSION->shaper);
+    send_str(client, buf);
+    struct buf_pool_stats ps;
+    struct arena_stats as;
+    buf_pool_get_stats(&ps);
+    arena_get_stats(&as);
+    dprintf(client, "io buffers: %d/%d in use, peak %d, %llu gets, %llu waits\n",
+            ps.in_use, ps.count, ps.peak, ps.gets, ps.waits);
+    dprintf(client, "session state: %zu bytes; arena chunks: %lu (%lu free, %lu large), peak request %zu bytes\n",
+            sizeof(struct session), as.chunks, as.chunks_free, as.large, as.peak_request);
+    unsigned sessions;
+    int threads, idle;
+    sv_get_stats(&sessions, &threads, &idle);
+    dprintf(client, "worker %d: %u sessions, %d threads (%d idle)\n", (int)getpid(), sessions, threads, idle);
+    dprintf(client, "manifest entries: %llu\n", manifest_count());
+    struct cas_stats cs;
+    cas_get_stats(&cs);
+    unsigned long long asked = cs.hits + cs.misses;
+    dprintf(client, "dedup: %llu hits, %llu misses (%.1f%% hit rate), %llu bytes saved, %llu objects stored, %llu swept\n",
+            cs.hits, cs.misses, asked ? 100.0 * (double)cs.hits / (double)asked : 0.0,
+            cs.bytes_saved, cs.objects, cs.swept);
+    send_str(client, "END\n");
+}
+
+/* Reads the extent table of a sparse upload: n lines "<offset> <length>".
+   Returns the payload length, or -1 if a line does not parse (the stream
+   is then lost). *ok tells whether the extents are usable: sorted, not
+   overlapping and inside size. */
+static long long recv_extents(int client, struct recv_extent *ext, long long n,
+                              long long size, int *ok) {
+    char line[64];
+    long long payload = 0, end = 0;
+    *ok = 1;
+    for (long long i = 0; i < n; i++) {
+        if (recv_line(client, line, sizeof(line)) < 0 ||
+            sscanf(line, "%lld %lld", &ext[i].off, &ext[i].len) != 2 ||
+            ext[i].len < 0 || ext[i].len > LLONG_MAX - payload) return -1;
+        if (ext[i].off < end || ext[i].len > size - ext[i].off) *ok = 0;
+        end = ext[i].off + ext[i].len;
+        payload += ext[i].len;
+    }
+    return payload;
+}
+
+/* write_file: name line, then "SIZE <n>" and n bytes, or
+   "SPARSE <size> <count>", count extent lines and only their data.
+   "HASH <size> <sha256>" asks for the dedup store first: the reply is
+   "HAVE" (the file is placed, the usual OK follows) or "SEND", after
+   which the client goes on with SIZE; the data must match the hash.
+   SPARSE bodies are never hashed, so one after HASH is refused. */
+static void handle_write_file(int client) {
+    char *fname = req_alloc(PATH_MAX);
+    if (recv_line(client, fname, PATH_MAX) < 0 || fname[0] == '\0') {
+        send_str(client, "filename error\n");
+        return;
+    }
+    char *sizeln = req_alloc(128);
+    if (recv_line(client, sizeln, 128) < 0) {
+        send_str(client, "size error\n");
+        return;
+    }
+    long long fsz = -1, next = -1, payload;
+    struct recv_extent *ext = NULL;
+    int ext_ok = 1;
+    unsigned char want[SHA256_LEN];
+    char hex[SHA256_LEN * 2 + 1];
+    int hashed = 0, refused = 0;
+    if (sscanf(sizeln, "HASH %lld %64s", &fsz, hex) == 2) {
+        char *canon = req_alloc(PATH_MAX);
+        hashed = fsz >= 0 && strlen(hex) == SHA256_LEN * 2 && sha256_unhex(hex, want) == 0 &&
+                 secure_new_path_in_base(fname, canon, PATH_MAX);
+        if (hashed && place_from_store(canon, want, fsz) == 0) {
+            send_str(client, "HAVE\nOK\n");
+            return;
+        }
+        if (hashed && fsz >= CAS_MIN_SIZE) cas_count_miss();
+        /* The offer promised a check; without a usable hash the data
+           that follows cannot be checked. */
+        refused = !hashed;
+        send_str(client, "SEND\n");
+        if (recv_line(client, sizeln, 128) < 0) {
+            send_str(client, "size error\n");
+            return;
+        }
+        fsz = -1;
+    }
+    if (sscanf(sizeln, "SPARSE %lld %lld", &fsz, &next) == 2) {
+        if (fsz < 0 || next < 0 || next > SPARSE_MAX_EXTENTS) {
+            send_str(client, "bad size\n");
+            return;
+        }
+        ext = req_alloc((size_t)(next ? next : 1) * sizeof(*ext));
+        if ((payload = recv_extents(client, ext, next, fsz, &ext_ok)) < 0) {
+            send_str(client, "bad size\n");
+            return;
+        }
+        if (hashed) refused = 1;
+    } else if (sscanf(sizeln, "SIZE %lld", &fsz) != 1 || fsz < 0) {
+        send_str(client, "bad size\n");
+        return;
+    } else {
+        payload = fsz;
+    }
+    char *canon = req_alloc(PATH_MAX);
+    if (!ext_ok || refused || !secure_new_path_in_base(fname, canon, PATH_MAX) ||
+        is_manifest_rel(jail_rel(canon))) {
+        drain_n(client, payload);
+        send_str(client, "FAIL\n");
+        return;
+    }
+    struct stat before, after;
+    int existed = lstat(canon, &before) == 0;
+    unsigned epoch = du_index_epoch();      /* before the temporary appears */
+    /* The data goes to a temporary next to the target, renamed over it
+       only once all of it arrived (and matched the hash offered). An
+       upload that breaks off leaves the target as it was, and a target
+       sharing its inode with the dedup store is never written in place. */
+    char *tmp = upload_temp(canon, existed ? &before : NULL);
+    if (!tmp) {
+        drain_n(client, payload);
+        send_str(client, "FAIL\n");
+        return;
+    }
+    sha256_ctx hc;
+    sha256_init(&hc);
+    unsigned char hash[SHA256_LEN];
+    int rc;
+    if (ext) {
+        /* Holes are not hashed; ssync hashes the file when it needs to. */
+        rc = recv_pipe_to_file_sparse(client, tmp, fsz, ext, (size_t)next, &SESSION->shaper);
+    } else {
+        rc = recv_pipe_to_file(client, tmp, fsz, DIRECT_MIN > 0 && fsz >= DIRECT_MIN,
+                               &SESSION->shaper, &hc);
+        sha256_final(&hc, hash);
+        /* A hash the data does not match means the client's file changed
+           or the stream was damaged; it is not kept. */
+        if (rc == 0 && hashed && memcmp(hash, want, SHA256_LEN) != 0) rc = -1;
+    }
+    if (rc == 0 && rename(tmp, canon) != 0) rc = -1;
+    if (rc != 0) {
+        unlink(tmp);
+        send_str(client, "FAIL\n");
+        return;
+    }
+    if (ext) {
+        manifest_del(jail_rel(canon));
+    } else {
+        manifest_record(canon, hash);
+        cas_add(hash, canon);
+    }
+    /* Only now: the du index counts a file linked into the store by inode. */
+    if (lstat(canon, &after) == 0)
+        du_index_file(canon, existed ? &before : NULL, &after, epoch);
+    send_str(client, "OK\n");
+}
+
+/* Short commands that bulk transfers give way to. Anything that may
+   move data or walk a tree (uploads, scopy, srm, ssync, sfind, sdu,
+   sbatch, ssub) is bulk itself and must not make uploads pause. */
+static int is_control_command(const char *cmdline) {
+    static const char *const control[] = {
+        "spwd", "scd", "sls", "slist", "smkdir", "srename", "sstat", "srate", "sunsub", "scancel",
+    };
+    size_t n = strcspn(cmdline, " ");
+    for (size_t i = 0; i < sizeof(control) / sizeof(control[0]); i++)
+        if (strlen(control[i]) == n && strncmp(cmdline, control[i], n) == 0) return 1;
+    return 0;
+}
+
 static void handle_command(int client, char *cmdline) {
     if (strcmp(cmdline, "spwd") == 0) {
-        char cwd[PATH_MAX];
-        if (getcwd(cwd, sizeof(cwd))) {
+        char *cwd = req_alloc(PATH_MAX);
+        if (getcwd(cwd, PATH_MAX)) {
             if (starts_with(cwd, BASE_DIR)) {
                 const char *rel = cwd + strlen(BASE_DIR);
                 if (*rel == '\0') rel = "/";
@@ -134,6 +999,7 @@ static void handle_command(int client, char *cmdline) {
         int count = 0;
         while ((e = readdir(d))) {
             if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            if (manifest_hidden_at(dirfd(d), e->d_name)) continue;
             dprintf(client, "%s\n", e->d_name);
             count++;
         }
@@ -141,66 +1007,386 @@ static void handle_command(int client, char *cmdline) {
         if (!count) send_str(client, "(empty)\n");
         return;
     }
+    if (strcmp(cmdline, "slist") == 0 || strncmp(cmdline, "slist ", 6) == 0) {
+        handle_slist(client, cmdline + 5);
+        return;
+    }
     if (strncmp(cmdline, "smkdir ", 7) == 0) {
-        const char *name = cmdline + 7;
-        if (mkdir(name, 0777) == 0) send_str(client, "Directory created\n");
+        if (op_mkdir(cmdline + 7) == 0) send_str(client, "Directory created\n");
         else send_str(client, "Failed to create directory\n");
         return;
     }
     if (strncmp(cmdline, "srm ", 4) == 0) {
-        const char *path = cmdline + 4;
-        char canon[PATH_MAX];
-        if (!realpath(path, canon) || !secure_path_in_base(canon)) {
-            send_str(client, "Failed to delete\n");
-            return;
-        }
-        if (delete_directory(canon) == 0) send_str(client, "Deleted\n");
+        if (op_rm(cmdline + 4) == 0) send_str(client, "Deleted\n");
         else send_str(client, "Failed to delete\n");
         return;
     }
     if (strncmp(cmdline, "srename ", 8) == 0) {
-        char tmp[PATH_MAX * 2 + 16];
-        strncpy(tmp, cmdline + 8, sizeof(tmp)-1);
-        tmp[sizeof(tmp)-1] = '\0';
-        char *oldn = strtok(tmp, " \t\r\n");
-        char *newn = strtok(NULL, " \t\r\n");
-        if (oldn && newn) {
-            char c1[PATH_MAX], c2[PATH_MAX];
-            if (realpath(oldn, c1) && realpath(newn, c2) &&
-                secure_path_in_base(c1) && secure_path_in_base(c2) &&
-                rename(c1, c2) == 0) {
-                send_str(client, "Renamed\n");
-            } else {
-                send_str(client, "Rename failed\n");
-            }
-        } else send_str(client, "Invalid rename command\n");
+        int rc = op_rename(cmdline + 8);
+        if (rc == 0) send_str(client, "Renamed\n");
+        else if (rc == -2) send_str(client, "Invalid rename command\n");
+        else send_str(client, "Rename failed\n");
+        return;
+    }
+    if (strncmp(cmdline, "scopy ", 6) == 0) {
+        int rc = op_copy(cmdline + 6);
+        if (rc == 0) send_str(client, "Copied\n");
+        else if (rc == -2) send_str(client, "Invalid copy command\n");
+        else send_str(client, "Copy failed\n");
+        return;
+    }
+    if (strncmp(cmdline, "sbatch ", 7) == 0) {
+        handle_sbatch(client, cmdline + 7);
+        return;
+    }
+    if (strcmp(cmdline, "sfind") == 0 || strncmp(cmdline, "sfind ", 6) == 0) {
+        handle_sfind(client, cmdline + 5);
+        return;
+    }
+    if (strcmp(cmdline, "scancel") == 0) return;   /* late cancel of a finished sfind */
+    if (strcmp(cmdline, "sdu") == 0 || strncmp(cmdline, "sdu ", 4) == 0) {
+        handle_sdu(client, cmdline[3] ? cmdline + 4 : "");
+        return;
+    }
+    if (strncmp(cmdline, "srate ", 6) == 0) {
+        handle_srate(client, cmdline + 6);
+        return;
+    }
+    if (strcmp(cmdline, "ssub") == 0 || strncmp(cmdline, "ssub ", 5) == 0) {
+        handle_ssub(client, cmdline + 4);
+        return;
+    }
+    if (strcmp(cmdline, "sunsub") == 0) {
+        watch_close(SESSION->watch);
+        SESSION->watch = NULL;
+        send_str(client, "Unsubscribed\n");
+        return;
+    }
+    if (strcmp(cmdline, "sstat") == 0) {
+        handle_sstat(client);
+        return;
+    }
+    if (strncmp(cmdline, "ssync ", 6) == 0) {
+        handle_ssync(client, cmdline + 6);
         return;
     }
     if (strcmp(cmdline, "write_file") == 0) {
-        char fname[PATH_MAX];
-        if (recv_line(client, fname, sizeof(fname)) < 0 || fname[0] == '\0') {
-            send_str(client, "filename error\n");
-            return;
+        handle_write_file(client);
+        return;
+    }
+
+    send_str(client, "Unknown command\n");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--rate-global BYTES_PER_SEC] [--rate-session BYTES_PER_SEC]\n"
+                    "          [--direct-min BYTES] [--workers N]\n"
+                    "  sizes and rates take a k/M/G suffix; 0 means unlimited (or, for\n"
+                    "  --direct-min, never use O_DIRECT)\n"
+                    "  --workers N runs N worker processes under a supervisor: SIGHUP\n"
+                    "  restarts them, SIGUSR2 re-executes the binary, both without\n"
+                    "  dropping connections\n", argv0);
+}
+
+/* ---- the worker loop ----
+   One thread waits in epoll for the listener and every idle session;
+   a session with input (or subscription events) is queued for a pool
+   thread, which serves it until it is idle again and hands it back.
+   Sessions are armed EPOLLONESHOT, so only one thread at a time ever
+   sees one. Pool threads have their own working directory (CLONE_FS),
+   which each command sets to the session's. */
+static int sv_ep = -1, sv_evfd = -1;         /* sv_evfd: a session ended */
+static pthread_mutex_t sv_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sv_cv = PTHREAD_COND_INITIALIZER;
+static struct session *sv_run, *sv_run_tail;
+static struct session *sv_all;
+static struct session *sv_dead;             /* closed, freed by the loop */
+static unsigned sv_sessions;
+static int sv_nrun, sv_threads, sv_idle, sv_starting;
+
+static void sv_arm(int fd, struct session *s) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = s };
+    if (epoll_ctl(sv_ep, EPOLL_CTL_MOD, fd, &ev) != 0 && errno == ENOENT)
+        epoll_ctl(sv_ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Serves s until it has nothing left to do. Returns 0 when the session
+   is idle again, -1 once it has ended. */
+static int serve_session(struct session *s) {
+    int c = s->fd;
+    SESSION = s;
+    for (;;) {
+        /* Idle sessions hold no buffers: the line is only allocated
+           once a command has started to arrive. Subscription events
+           are delivered from here, between commands; while some wait
+           out their coalescing window the thread stays. A stopping
+           server still answers a command that is already waiting; a
+           reload does not touch established sessions at all. */
+        int stopping = supervisor_stopping();
+        int wait = s->watch && !stopping ? watch_timeout_ms(s->watch) : 0;
+        struct pollfd pfd[2] = { { c, POLLIN, 0 }, { s->watch ? watch_fd(s->watch) : -1, POLLIN, 0 } };
+        int pr = poll(pfd, 2, wait < 0 ? 0 : wait);
+        if (pr < 0 && errno != EINTR) break;
+        if (s->watch) {
+            if (pr > 0 && (pfd[1].revents & POLLIN)) watch_collect(s->watch);
+            if (watch_flush(s->watch, c) != 0) { printf("Client disconnected.\n"); break; }
         }
-        char sizeln[128];
-        if (recv_line(client, sizeln, sizeof(sizeln)) < 0) {
-            send_str(client, "size error\n");
-            return;
+        if (pr <= 0 || !(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (stopping) { printf("Closing idle session for shutdown.\n"); break; }
+            if (s->watch && watch_timeout_ms(s->watch) >= 0) continue;
+            SESSION = NULL;
+            return 0;
         }
-        long long fsz = -1;
-        if (sscanf(sizeln, "SIZE %lld", &fsz) != 1 || fsz < 0) {
-            send_str(client, "bad size\n");
-            return;
+        if (fchdir(s->cwd_fd >= 0 ? s->cwd_fd : ROOT_FD) != 0) { printf("Session directory lost.\n"); break; }
+        char *line = req_alloc(CMD_LINE_MAX);
+        int r = recv_line(c, line, CMD_LINE_MAX);
+        if (r <= 0) { printf("Client disconnected.\n"); break; }
+        if (line[0] == '\0') { send_str(c, "Empty command\n"); arena_reset(&s->arena); continue; }
+        printf("[DBG] cmd='%s'\n", line);
+        fflush(stdout);
+        int control = is_control_command(line);
+        if (control) shaper_control_begin();
+        handle_command(c, line);
+        if (control) shaper_control_end();
+        arena_reset(&s->arena);
+    }
+    arena_reset(&s->arena);
+    watch_close(s->watch);
+    s->watch = NULL;
+    shaper_session_end(&s->shaper);
+    if (s->cwd_fd >= 0) close(s->cwd_fd);
+    SESSION = NULL;
+    close(c);
+    return -1;
+}
+
+static void sv_get_stats(unsigned *sessions, int *threads, int *idle) {
+    pthread_mutex_lock(&sv_mu);
+    *sessions = sv_sessions;
+    *threads = sv_threads;
+    *idle = sv_idle;
+    pthread_mutex_unlock(&sv_mu);
+}
+
+/* Caller holds sv_mu. */
+static void sv_queue(struct session *s) {
+    if (s->busy) { s->again = 1; return; }
+    s->busy = 1;
+    s->next_run = NULL;
+    if (sv_run_tail) sv_run_tail->next_run = s; else sv_run = s;
+    sv_run_tail = s;
+    sv_nrun++;
+}
+
+/* Signals are for the loop thread, whose epoll_wait they interrupt;
+   threads it starts block them first. */
+static void sv_block_signals(sigset_t *old) {
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, old);
+}
+
+static void *sv_thread(void *arg) {
+    (void)arg;
+    sv_block_signals(NULL);
+    /* A cwd of its own, which its sessions fchdir() into. */
+    if (unshare(CLONE_FS) != 0) { perror("unshare"); exit(1); }
+    pthread_mutex_lock(&sv_mu);
+    sv_starting--;
+    for (;;) {
+        int timed_out = 0;
+        while (!sv_run) {
+            /* A burst's threads go away again once it is over. */
+            if (timed_out && sv_threads > SESSION_THREADS_KEEP) {
+                sv_threads--;
+                pthread_mutex_unlock(&sv_mu);
+                return NULL;
+            }
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += SESSION_THREAD_IDLE;
+            sv_idle++;
+            timed_out = pthread_cond_timedwait(&sv_cv, &sv_mu, &until) == ETIMEDOUT;
+            sv_idle--;
         }
-        if (recv_n_to_file(client, fname, fsz) == 0) send_str(client, "OK\n");
-        else send_str(client, "FAIL\n");
-        return;
+        struct session *s = sv_run;
+        if (!(sv_run = s->next_run)) sv_run_tail = NULL;
+        sv_nrun--;
+        for (;;) {
+            s->again = 0;
+            pthread_mutex_unlock(&sv_mu);
+            int rc = serve_session(s);
+            pthread_mutex_lock(&sv_mu);
+            if (rc != 0) {
+                /* Still busy, so events already fetched for it are ignored. */
+                if (s->prev) s->prev->next = s->next; else sv_all = s->next;
+                if (s->next) s->next->prev = s->prev;
+                s->next = sv_dead;
+                sv_dead = s;
+                sv_sessions--;
+                /* A draining loop is waiting for the last one. */
+                if (supervisor_draining()) eventfd_write(sv_evfd, 1);
+                break;
+            }
+            /* Armed while still busy: a wake-up in between sets again. */
+            sv_arm(s->fd, s);
+            if (s->watch) sv_arm(watch_fd(s->watch), s);
+            if (!s->again) { s->busy = 0; break; }
+        }
+    }
+    return NULL;
 }
 
-    send_str(client, "Unknown command\n");
+/* Caller holds sv_mu. A thread for every queued session, up to the cap;
+   past it sessions wait their turn. Idle threads retire after a while. */
+static void sv_wake(void) {
+    if (!sv_nrun) return;
+    for (int need = sv_nrun - sv_idle - sv_starting; need > 0 && sv_threads < SESSION_THREADS_MAX; need--) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, sv_thread, NULL) != 0) break;
+        pthread_detach(t);
+        sv_threads++;
+        sv_starting++;
+    }
+    if (sv_nrun > 1) pthread_cond_broadcast(&sv_cv);
+    else pthread_cond_signal(&sv_cv);
+}
+
+/* Returns -1 once out of descriptors: the connection stays queued and
+   the loop stops polling the listener for a moment rather than spin. */
+static int sv_accept(int srv) {
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t pl = sizeof(peer);
+        int c = accept4(srv, (struct sockaddr*)&peer, &pl, SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno == EMFILE || errno == ENFILE) return -1;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                perror("accept");
+            if (errno != ECONNABORTED && errno != EINTR) return 0;
+            continue;
+        }
+        struct session *s = calloc(1, sizeof(*s));
+        if (!s) { send_str(c, "Server busy\n"); close(c); continue; }
+        printf("Client connected.\n");
+        s->fd = c;
+        s->cwd_fd = -1;             /* every session starts at the jail root */
+        s->admin = peer.sin_family == AF_INET && (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+        shaper_session_begin(&s->shaper);
+        pthread_mutex_lock(&sv_mu);
+        if ((s->next = sv_all)) sv_all->prev = s;
+        sv_all = s;
+        sv_sessions++;
+        pthread_mutex_unlock(&sv_mu);
+        sv_arm(c, s);
+    }
+}
+
+/* Runs the worker until it stops accepting and its last session ends. */
+static void serve(int srv) {
+    sv_ep = epoll_create1(EPOLL_CLOEXEC);
+    if (sv_ep < 0) { perror("epoll"); return; }
+    fcntl(srv, F_SETFL, fcntl(srv, F_GETFL) | O_NONBLOCK);
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(sv_ep, EPOLL_CTL_ADD, srv, &lev);
+    sv_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event eev = { .events = EPOLLIN, .data.ptr = &sv_evfd };
+    if (sv_evfd >= 0) epoll_ctl(sv_ep, EPOLL_CTL_ADD, sv_evfd, &eev);
+    int stopped = 0, paused = 0;
+    for (;;) {
+        pthread_mutex_lock(&sv_mu);
+        while (sv_dead) {
+            struct session *d = sv_dead;
+            sv_dead = d->next;
+            free(d);
+        }
+        /* A stop wakes every idle session once; each closes as soon as
+           it has answered what was already waiting. */
+        if (supervisor_stopping() && !stopped) {
+            stopped = 1;
+            for (struct session *s = sv_all; s; s = s->next) sv_queue(s);
+            sv_wake();
+        }
+        unsigned open_sessions = sv_sessions;
+        pthread_mutex_unlock(&sv_mu);
+        if (supervisor_draining() && srv >= 0) {
+            if (!paused) epoll_ctl(sv_ep, EPOLL_CTL_DEL, srv, NULL);
+            close(srv);
+            srv = -1;
+        }
+        if (srv < 0 && open_sessions == 0) break;
+        struct epoll_event evs[64];
+        int n = epoll_wait(sv_ep, evs, 64, paused ? 100 : 1000);
+        if (paused && srv >= 0) {
+            epoll_ctl(sv_ep, EPOLL_CTL_ADD, srv, &lev);
+            paused = 0;
+        }
+        pthread_mutex_lock(&sv_mu);
+        for (int i = 0; i < n; i++) {
+            struct session *s = evs[i].data.ptr;
+            if (!s) continue;
+            if (s == (void *)&sv_evfd) { eventfd_t v; eventfd_read(sv_evfd, &v); continue; }
+            sv_queue(s);
+        }
+        sv_wake();
+        pthread_mutex_unlock(&sv_mu);
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.ptr || srv < 0 || supervisor_draining()) continue;
+            if (sv_accept(srv) != 0) {
+                epoll_ctl(sv_ep, EPOLL_CTL_DEL, srv, NULL);
+                paused = 1;
+            }
+            break;
+        }
+    }
+    if (sv_evfd >= 0) close(sv_evfd);
+    close(sv_ep);
 }
 
-int main(void) {
+/* Per-process state: the du index threads do not survive a fork, so
+   each worker sets them up itself; its sessions share them. */
+static void worker_setup(void) {
+    /* Most replies are plain send(); a client vanishing mid-reply must
+       end its session, not the process. */
+    signal(SIGPIPE, SIG_IGN);
+    if (buf_pool_init(IO_BUF_SIZE, IO_BUF_COUNT) != 0) { perror("buffer pool"); exit(1); }
+    char mf[PATH_MAX + 16];
+    snprintf(mf, sizeof(mf), "%s/%s", BASE_DIR, MANIFEST_NAME);
+    if (manifest_open(mf) != 0) perror("manifest");
+    sigset_t old;
+    sv_block_signals(&old);
+    snprintf(mf, sizeof(mf), "%s/%s", BASE_DIR, CAS_DIR_NAME);
+    if (cas_open(mf) != 0) perror("dedup store");
+    snprintf(mf, sizeof(mf), "%s/%s", BASE_DIR, DU_JOURNAL_NAME);
+    if (du_index_start(BASE_DIR, mf, worker_count()) != 0)
+        fprintf(stderr, "du index disabled: initial scan could not start\n");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void worker_main(int srv, int slot) {
+    worker_setup();
+    printf("Worker %d (pid %d) ready\n", slot, (int)getpid());
+    fflush(stdout);
+    serve(srv);
+    printf("Worker %d (pid %d) drained\n", slot, (int)getpid());
+}
+
+int main(int argc, char **argv) {
+    long long rate_global = 0, rate_session = 0, workers = 0;
+    for (int i = 1; i < argc; i++) {
+        long long *dst = !strcmp(argv[i], "--rate-global") ? &rate_global :
+                         !strcmp(argv[i], "--rate-session") ? &rate_session :
+                         !strcmp(argv[i], "--direct-min") ? &DIRECT_MIN :
+                         !strcmp(argv[i], "--workers") ? &workers : NULL;
+        if (!dst || i + 1 >= argc || parse_cmp_number(argv[++i], 1, dst) != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (shaper_init(rate_global, rate_session) != 0) { perror("shaper"); return 1; }
     if (!getcwd(START_DIR, sizeof(START_DIR))) {
         perror("getcwd"); return 1;
     }
@@ -214,34 +1400,24 @@ int main(void) {
             BASE_DIR[sizeof(BASE_DIR)-1] = '\0';
         }
     }
-    int srv = socket(AF_INET, SOCK_STREAM, 0);
-    if (srv < 0) { perror("socket"); return 1; }
-    int opt=1; setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port   = htons(5000);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (listen(srv, 8) < 0) { perror("listen"); return 1; }
-    printf("Server listening on 0.0.0.0:5000\nBASE_DIR (jail): %s\n", BASE_DIR);
-    for (;;) {
-        struct sockaddr_in cli; socklen_t cl = sizeof(cli);
-        int c = accept(srv, (struct sockaddr*)&cli, &cl);
-        if (c < 0) { perror("accept"); continue; }
-        printf("Client connected.\n");
-
-        char line[2048];  
-        for (;;) {
-            int r = recv_line(c, line, sizeof(line));
-            if (r <= 0) { printf("Client disconnected.\n"); break; }
-            if (line[0] == '\0') { send_str(c, "Empty command\n"); continue; }
-            printf("[DBG] cmd='%s'\n", line);
-            fflush(stdout);
-            handle_command(c, line);   
+    if (manifest_hide(BASE_DIR) != 0) { perror("jail"); return 1; }
+    ROOT_FD = open(BASE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ROOT_FD < 0) { perror("jail"); return 1; }
+    UMASK = umask(0);
+    umask(UMASK);
+    if (workers > 0) {
+        /* Re-executing must find the binary again even if argv[0] was
+           relative to a directory we have since left. */
+        char self[PATH_MAX];
+        if (!realpath(argv[0], self)) snprintf(self, sizeof(self), "/proc/self/exe");
+        printf("BASE_DIR (jail): %s\n", BASE_DIR);
+        return supervisor_run(self, argv, (int)workers, 5000, worker_main) != 0;
     }
-    close(c);
-}
-
+    worker_setup();
+    int srv = listen_socket(5000, 0, LISTEN_BACKLOG);
+    if (srv < 0) { perror("listen"); return 1; }
+    printf("Server listening on 0.0.0.0:5000\nBASE_DIR (jail): %s\n", BASE_DIR);
+    serve(srv);
     close(srv);
     return 0;
-}
\ No newline at end of file
+}
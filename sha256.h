@@ -0,0 +1,26 @@
+#ifndef SHA256_H
+#define SHA256_H
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+#define SHA256_LEN 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t used;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const void *data, size_t n);
+void sha256_final(sha256_ctx *c, unsigned char out[SHA256_LEN]);
+void sha256_hex(const unsigned char hash[SHA256_LEN], char out[SHA256_LEN * 2 + 1]);
+int  sha256_unhex(const char *hex, unsigned char out[SHA256_LEN]);
+int  sha256_file(const char *path, unsigned char out[SHA256_LEN]);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include "shaper.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Longest a bulk chunk waits for control commands before going ahead
+   anyway, so a stream of commands cannot starve a transfer. */
+#define SHAPER_MAX_YIELD_US 20000
+#define SHAPER_MIN_BURST 65536.0
+/* Control commands running at once that bulk transfers give way to. */
+#define SHAPER_MAX_CONTROL 64
+/* Processes whose sessions are counted one by one; see rebuild_sessions. */
+#define SHAPER_MAX_PROCS 1024
+
+struct shaper_proc {
+    pid_t pid;
+    int sessions;
+};
+
+/* mu is robust: a process killed while holding it (OOM, the SIGKILL of a
+   second SIGTERM) does not stall every transfer on the server. */
+struct shaper_shared {
+    pthread_mutex_t mu;
+    struct token_bucket global;
+    long long default_rate;
+    pid_t control_pid[SHAPER_MAX_CONTROL];  /* owner of each running control command */
+    struct shaper_proc procs[SHAPER_MAX_PROCS];
+    int sessions;
+    unsigned long long control_cmds;
+    unsigned long long bulk_yields;
+};
+
+static struct shaper_shared *sh;
+static __thread int control_slot = -1;  /* this thread's slot in control_pid */
+
+static double now_mono(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_us(unsigned long long us){
+    struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0) ;
+}
+
+static int pid_dead(pid_t p){
+    return kill(p, 0) != 0 && errno == ESRCH;
+}
+
+/* Caller holds mu. Forgets processes that have gone and recounts the
+   sessions from those left. */
+static void rebuild_sessions(void){
+    int n = 0;
+    for (int i = 0; i < SHAPER_MAX_PROCS; i++) {
+        struct shaper_proc *p = &sh->procs[i];
+        if (p->pid && pid_dead(p->pid)) p->pid = 0;
+        if (!p->pid) p->sessions = 0;
+        n += p->sessions;
+    }
+    sh->sessions = n;
+}
+
+/* The owner may have died mid-update; the buckets survive whatever it
+   left half done, the session count is rebuilt. */
+static void sh_lock(void){
+    if (pthread_mutex_lock(&sh->mu) == EOWNERDEAD) {
+        pthread_mutex_consistent(&sh->mu);
+        rebuild_sessions();
+    }
+}
+
+static void sh_unlock(void){
+    pthread_mutex_unlock(&sh->mu);
+}
+
+/* Caller holds mu. This process's entry in procs, made if need be;
+   NULL if the table is full. */
+static struct shaper_proc *my_proc(int create){
+    pid_t me = getpid();
+    struct shaper_proc *free_slot = NULL;
+    for (int i = 0; i < SHAPER_MAX_PROCS; i++) {
+        struct shaper_proc *p = &sh->procs[i];
+        if (p->pid == me) return p;
+        if (!free_slot && (!p->pid || (create && pid_dead(p->pid)))) free_slot = p;
+    }
+    if (!create || !free_slot) return NULL;
+    free_slot->pid = me;
+    free_slot->sessions = 0;
+    return free_slot;
+}
+
+static void bucket_set(struct token_bucket *b, long long rate){
+    b->rate = rate > 0 ? rate : 0;
+    b->tokens = 0;
+    b->last = now_mono();
+}
+
+/* Charges n bytes and returns how long the caller must sleep to stay
+   within the rate. */
+static double bucket_charge(struct token_bucket *b, size_t n, double now){
+    b->bytes += n;
+    if (b->rate <= 0) { b->last = now; return 0; }
+    double burst = b->rate / 10.0 > SHAPER_MIN_BURST ? b->rate / 10.0 : SHAPER_MIN_BURST;
+    b->tokens += (now - b->last) * (double)b->rate;
+    b->last = now;
+    if (b->tokens > burst) b->tokens = burst;
+    b->tokens -= (double)n;
+    return b->tokens < 0 ? -b->tokens / (double)b->rate : 0;
+}
+
+int shaper_init(long long global_rate, long long session_rate){
+    void *p = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    sh = p;
+    memset(sh, 0, sizeof(*sh));
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    pthread_mutexattr_setpshared(&a, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&a, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sh->mu, &a);
+    pthread_mutexattr_destroy(&a);
+    bucket_set(&sh->global, global_rate);
+    sh->default_rate = session_rate > 0 ? session_rate : 0;
+    return 0;
+}
+
+void shaper_session_begin(struct shaper_session *s){
+    memset(s, 0, sizeof(*s));
+    sh_lock();
+    bucket_set(&s->bucket, sh->default_rate);
+    struct shaper_proc *p = my_proc(1);
+    if (p) p->sessions++;
+    sh->sessions++;
+    sh_unlock();
+}
+
+void shaper_session_end(struct shaper_session *s){
+    (void)s;
+    sh_lock();
+    struct shaper_proc *p = my_proc(0);
+    if (p && --p->sessions <= 0) p->pid = 0;
+    if (sh->sessions > 0) sh->sessions--;
+    sh_unlock();
+}
+
+void shaper_control_begin(void){
+    pid_t me = getpid();
+    for (int i = 0; i < SHAPER_MAX_CONTROL && control_slot < 0; i++) {
+        pid_t free_slot = 0;
+        if (__atomic_compare_exchange_n(&sh->control_pid[i], &free_slot, me, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            control_slot = i;
+    }
+    __atomic_add_fetch(&sh->control_cmds, 1, __ATOMIC_RELAXED);
+}
+
+void shaper_control_end(void){
+    if (control_slot >= 0) __atomic_store_n(&sh->control_pid[control_slot], 0, __ATOMIC_SEQ_CST);
+    control_slot = -1;
+}
+
+/* Whether a control command is running anywhere. A slot whose owner died
+   mid-command is released here rather than stalling bulk transfers. */
+static int control_running(void){
+    int any = 0;
+    for (int i = 0; i < SHAPER_MAX_CONTROL; i++) {
+        pid_t p = __atomic_load_n(&sh->control_pid[i], __ATOMIC_SEQ_CST);
+        if (!p) continue;
+        if (pid_dead(p)) {
+            __atomic_compare_exchange_n(&sh->control_pid[i], &p, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        any = 1;
+    }
+    return any;
+}
+
+void shaper_take(struct shaper_session *s, size_t n){
+    unsigned long long waited = 0;
+    double now = now_mono();
+    if (now >= s->no_yield_until && control_running()) {
+        __atomic_add_fetch(&sh->bulk_yields, 1, __ATOMIC_RELAXED);
+        while (waited < SHAPER_MAX_YIELD_US && control_running()) {
+            sleep_us(1000);
+            waited += 1000;
+        }
+        s->yield_us += waited;
+        /* A command that outlives the whole wait must not throttle
+           every following chunk too. */
+        if (waited >= SHAPER_MAX_YIELD_US) s->no_yield_until = now + 1.0;
+        now = now_mono();
+    }
+
+    double ws = bucket_charge(&s->bucket, n, now);
+    sh_lock();
+    double wg = bucket_charge(&sh->global, n, now);
+    unsigned long long us = (unsigned long long)((wg > ws ? wg : ws) * 1e6);
+    if (wg > 0 && wg >= ws) { sh->global.throttled_us += us; sh->global.throttle_events++; }
+    sh_unlock();
+    if (ws > 0 && ws > wg) { s->bucket.throttled_us += us; s->bucket.throttle_events++; }
+    if (us) sleep_us(us);
+}
+
+void shaper_set_global(long long rate){
+    sh_lock();
+    bucket_set(&sh->global, rate);
+    sh_unlock();
+}
+
+void shaper_set_default(long long rate){
+    sh_lock();
+    sh->default_rate = rate > 0 ? rate : 0;
+    sh_unlock();
+}
+
+void shaper_set_session(struct shaper_session *s, long long rate){
+    bucket_set(&s->bucket, rate);
+}
+
+static const char *fmt_rate(char *buf, size_t n, long long rate){
+    if (rate <= 0) snprintf(buf, n, "unlimited");
+    else snprintf(buf, n, "%lld B/s", rate);
+    return buf;
+}
+
+int shaper_format_stats(char *buf, size_t n, const struct shaper_session *s){
+    char r1[32], r2[32], r3[32];
+    sh_lock();
+    /* Processes killed outright never ended their sessions. */
+    rebuild_sessions();
+    struct token_bucket gb = sh->global;
+    long long def = sh->default_rate;
+    int sessions = sh->sessions;
+    sh_unlock();
+    return snprintf(buf, n,
+        "rate global: %s, %llu bytes, throttled %llu ms (%llu times)\n"
+        "rate session: %s, %llu bytes, throttled %llu ms (%llu times), yielded %llu ms\n"
+        "rate default: %s\n"
+        "sessions: %d, control commands: %llu, bulk yields: %llu\n",
+        fmt_rate(r1, sizeof(r1), gb.rate), gb.bytes, gb.throttled_us / 1000, gb.throttle_events,
+        fmt_rate(r2, sizeof(r2), s->bucket.rate), s->bucket.bytes,
+        s->bucket.throttled_us / 1000, s->bucket.throttle_events, s->yield_us / 1000,
+        fmt_rate(r3, sizeof(r3), def), sessions,
+        __atomic_load_n(&sh->control_cmds, __ATOMIC_RELAXED),
+        __atomic_load_n(&sh->bulk_yields, __ATOMIC_RELAXED));
+}
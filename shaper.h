@@ -0,0 +1,39 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct token_bucket {
+    long long rate;                 /* bytes per second; 0: unlimited */
+    double tokens;                  /* may go negative: debt paid by sleeping */
+    double last;                    /* monotonic seconds of the last refill */
+    unsigned long long bytes;
+    unsigned long long throttled_us;
+    unsigned long long throttle_events;
+};
+
+struct shaper_session {
+    struct token_bucket bucket;
+    unsigned long long yield_us;    /* time spent giving way to control commands */
+    double no_yield_until;          /* set after a yield timed out */
+};
+
+/* Bulk payload I/O is charged against a per-session and a global token
+   bucket. Control commands are marked while they run; bulk transfers in
+   other sessions pause between chunks until none are active. The global
+   state lives in a shared mapping so forked workers see one budget. */
+int  shaper_init(long long global_rate, long long session_rate);
+void shaper_session_begin(struct shaper_session *s);
+void shaper_session_end(struct shaper_session *s);
+void shaper_control_begin(void);
+void shaper_control_end(void);
+void shaper_take(struct shaper_session *s, size_t n);
+void shaper_set_global(long long rate);
+void shaper_set_default(long long rate);
+void shaper_set_session(struct shaper_session *s, long long rate);
+int  shaper_format_stats(char *buf, size_t n, const struct shaper_session *s);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include "supervisor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define SUP_ENV_FDS "SERVER_LISTEN_FDS"
+#define SUP_ENV_DRAIN "SERVER_DRAIN_PIDS"
+#define SUP_MAX_WORKERS 256
+#define SUP_MAX_DRAINING 1024
+#define SUP_BACKLOG 128
+
+struct slot {
+    int fd, cpu;
+    pid_t pid;
+    time_t started, restart_at;     /* restart_at: respawn pending after a crash */
+};
+
+static volatile sig_atomic_t wk_draining, wk_stopping;
+
+static struct slot slots[SUP_MAX_WORKERS];
+static int nslots;
+static pid_t draining[SUP_MAX_DRAINING];
+static int ndraining;
+
+/* Only flags: the worker's loop wakes up at least once a second, takes
+   the listener out of its set and closes it itself. */
+static void wk_on_retire(int sig){
+    (void)sig;
+    wk_draining = 1;
+}
+
+static void wk_on_term(int sig){
+    wk_on_retire(sig);
+    wk_stopping = 1;
+}
+
+int supervisor_draining(void){
+    return wk_draining;
+}
+
+int supervisor_stopping(void){
+    return wk_stopping;
+}
+
+int listen_socket(int port, int reuseport, int backlog){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        close(fd);
+        return -1;
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* The n-th CPU this process may run on, wrapping around. */
+static int nth_cpu(int n){
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0) return -1;
+    n %= CPU_COUNT(&set);
+    for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &set) && n-- == 0) return c;
+    return -1;
+}
+
+static void spawn(int i, worker_fn fn, const sigset_t *sigs){
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) { perror("supervisor: fork"); slots[i].restart_at = time(NULL) + 1; return; }
+    if (pid > 0) {
+        slots[i].pid = pid;
+        slots[i].started = time(NULL);
+        slots[i].restart_at = 0;
+        printf("supervisor: worker %d started, pid %d, cpu %d\n", i, (int)pid, slots[i].cpu);
+        fflush(stdout);
+        return;
+    }
+    for (int j = 0; j < nslots; j++) if (j != i) close(slots[j].fd);
+    if (slots[i].cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(slots[i].cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wk_on_term;
+    sa.sa_flags = SA_RESTART;       /* transfers in progress must not see EINTR */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = wk_on_retire;
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    /* Not the mask we started with: after a re-exec that one already
+       has these blocked. */
+    sigprocmask(SIG_UNBLOCK, sigs, NULL);
+    fn(slots[i].fd, i);
+    fflush(stdout);
+    _exit(0);
+}
+
+/* Retiring only closes the listener: the worker's sessions go on until
+   their clients leave, and the worker exits after the last one. */
+static void drain(pid_t pid){
+    if (pid <= 0) return;
+    kill(pid, SIGUSR1);
+    if (ndraining < SUP_MAX_DRAINING) draining[ndraining++] = pid;
+}
+
+static void reap(int stopping){
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < ndraining; i++)
+            if (draining[i] == pid) { draining[i--] = draining[--ndraining]; break; }
+        for (int i = 0; i < nslots; i++) {
+            if (slots[i].pid != pid) continue;
+            slots[i].pid = 0;
+            if (stopping) break;
+            fprintf(stderr, "supervisor: worker %d (pid %d) died, restarting\n", i, (int)pid);
+            /* Back off if it dies straight away. */
+            slots[i].restart_at = time(NULL) - slots[i].started < 1 ? time(NULL) + 1 : time(NULL);
+        }
+    }
+}
+
+/* Replaces this process image; the sockets stay open across exec and the
+   current workers are drained by the new supervisor. Returns on failure. */
+static void reexec(const char *self, char **argv){
+    char fds[SUP_MAX_WORKERS * 12], pids[(SUP_MAX_WORKERS + SUP_MAX_DRAINING) * 12];
+    size_t fl = 0, pl = 0;
+    fds[0] = pids[0] = '\0';
+    for (int i = 0; i < nslots; i++) {
+        fl += (size_t)snprintf(fds + fl, sizeof(fds) - fl, "%s%d", i ? "," : "", slots[i].fd);
+        fcntl(slots[i].fd, F_SETFD, 0);
+        if (slots[i].pid > 0) pl += (size_t)snprintf(pids + pl, sizeof(pids) - pl, "%s%d", pl ? "," : "", (int)slots[i].pid);
+    }
+    for (int i = 0; i < ndraining; i++)
+        pl += (size_t)snprintf(pids + pl, sizeof(pids) - pl, "%s%d", pl ? "," : "", (int)draining[i]);
+    setenv(SUP_ENV_FDS, fds, 1);
+    setenv(SUP_ENV_DRAIN, pids, 1);
+    printf("supervisor: re-executing %s\n", self);
+    fflush(stdout);
+    /* The signal mask survives exec, so nothing arriving meanwhile is lost. */
+    execv(self, argv);
+    perror("supervisor: exec");
+    for (int i = 0; i < nslots; i++) fcntl(slots[i].fd, F_SETFD, FD_CLOEXEC);
+    unsetenv(SUP_ENV_FDS);
+    unsetenv(SUP_ENV_DRAIN);
+}
+
+/* Sockets and workers handed over by a previous supervisor image. */
+static void inherit(void){
+    const char *fds = getenv(SUP_ENV_FDS), *pids = getenv(SUP_ENV_DRAIN);
+    for (const char *p = fds; p && *p; ) {
+        char *end;
+        long fd = strtol(p, &end, 10);
+        if (end == p) break;
+        int type = 0;
+        socklen_t len = sizeof(type);
+        if (nslots < SUP_MAX_WORKERS && getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &type, &len) == 0 && type) {
+            fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+            slots[nslots++].fd = (int)fd;
+        }
+        p = *end ? end + 1 : end;
+    }
+    for (const char *p = pids; p && *p; ) {
+        char *end;
+        long pid = strtol(p, &end, 10);
+        if (end == p) break;
+        if (pid > 0 && ndraining < SUP_MAX_DRAINING) draining[ndraining++] = (pid_t)pid;
+        p = *end ? end + 1 : end;
+    }
+    unsetenv(SUP_ENV_FDS);
+    unsetenv(SUP_ENV_DRAIN);
+}
+
+int supervisor_run(const char *self, char **argv, int workers, int port, worker_fn fn){
+    if (workers < 1 || workers > SUP_MAX_WORKERS) {
+        fprintf(stderr, "supervisor: between 1 and %d workers\n", SUP_MAX_WORKERS);
+        return -1;
+    }
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    inherit();
+    int fresh = ndraining > 0;
+    while (nslots > workers) close(slots[--nslots].fd);
+    while (nslots < workers) {
+        int fd = listen_socket(port, 1, SUP_BACKLOG);
+        if (fd < 0) { perror("supervisor: listen"); return -1; }
+        slots[nslots++].fd = fd;
+    }
+    for (int i = 0; i < nslots; i++) {
+        slots[i].cpu = nth_cpu(i);
+        spawn(i, fn, &set);
+    }
+    /* Only once the new workers run are the inherited ones told to stop. */
+    for (int i = 0; fresh && i < ndraining; i++) kill(draining[i], SIGUSR1);
+    printf("Supervisor %d: %d workers on 0.0.0.0:%d\n", (int)getpid(), nslots, port);
+    fflush(stdout);
+
+    int stopping = 0;
+    for (;;) {
+        reap(stopping);
+        int alive = ndraining;
+        for (int i = 0; i < nslots; i++) alive += slots[i].pid > 0;
+        if (stopping && alive == 0) break;
+        time_t now = time(NULL);
+        for (int i = 0; !stopping && i < nslots; i++)
+            if (slots[i].pid == 0 && slots[i].restart_at && slots[i].restart_at <= now) spawn(i, fn, &set);
+
+        struct timespec tick = { 1, 0 };
+        int sig = sigtimedwait(&set, NULL, &tick);
+        if (sig == SIGHUP && !stopping) {
+            printf("supervisor: reload\n");
+            for (int i = 0; i < nslots; i++) {
+                pid_t old = slots[i].pid;
+                spawn(i, fn, &set);
+                drain(old);
+            }
+        } else if (sig == SIGUSR2 && !stopping) {
+            reexec(self, argv);
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            if (stopping) {
+                for (int i = 0; i < nslots; i++) if (slots[i].pid > 0) kill(slots[i].pid, SIGKILL);
+                for (int i = 0; i < ndraining; i++) kill(draining[i], SIGKILL);
+            } else {
+                printf("supervisor: draining workers\n");
+                stopping = 1;
+                for (int i = 0; i < nslots; i++) if (slots[i].pid > 0) kill(slots[i].pid, SIGTERM);
+                for (int i = 0; i < ndraining; i++) kill(draining[i], SIGTERM);
+            }
+        }
+        fflush(stdout);
+    }
+    for (int i = 0; i < nslots; i++) close(slots[i].fd);
+    return 0;
+}
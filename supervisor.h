@@ -0,0 +1,26 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Pre-forked workers, one per slot, each pinned to a CPU and accepting on
+   its own SO_REUSEPORT socket. The sockets belong to the supervisor, so
+   no connection is refused while workers come and go:
+     SIGHUP          start a fresh worker per slot, then retire the old ones
+     SIGUSR2         re-execute the binary, passing the sockets and the
+                     workers to retire through the environment
+     SIGTERM/SIGINT  stop every worker and exit; a second one kills them
+   Workers that die are restarted. A retiring worker stops accepting; it
+   keeps serving the sessions it has until their clients disconnect, then
+   exits. A stopping worker's sessions should finish the command in
+   progress and end. */
+typedef void (*worker_fn)(int listen_fd, int slot);
+
+int listen_socket(int port, int reuseport, int backlog);
+int supervisor_run(const char *self, char **argv, int workers, int port, worker_fn fn);
+int supervisor_draining(void);          /* stop accepting */
+int supervisor_stopping(void);          /* end sessions once idle */
+#ifdef __cplusplus
+}
+#endif
+#endif
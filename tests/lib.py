@@ -0,0 +1,120 @@
+"""Helpers for the end-to-end checks: a server in a throwaway jail and a
+line-oriented connection to it. Standard library only."""
+import hashlib
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import traceback
+
+PORT = 5000
+
+
+def sha(data):
+    return hashlib.sha256(data).hexdigest()
+
+
+class Conn:
+    def __init__(self, timeout=10):
+        self.s = socket.create_connection(("127.0.0.1", PORT), timeout=timeout)
+        self.f = self.s.makefile("rb")
+
+    def send(self, data):
+        self.s.sendall(data if isinstance(data, bytes) else data.encode())
+
+    def line(self):
+        return self.f.readline().decode(errors="replace").rstrip("\n")
+
+    def cmd(self, line):
+        self.send(line + "\n")
+        return self.line()
+
+    def until_end(self):
+        """Lines up to and including the one starting with END."""
+        out = []
+        while True:
+            l = self.line()
+            out.append(l)
+            if l.startswith("END") or not l:
+                return out
+
+    def upload(self, name, data):
+        self.send(b"write_file\n%s\nSIZE %d\n" % (name.encode(), len(data)) + data)
+        return self.line()
+
+    def close(self):
+        self.f.close()
+        self.s.close()
+
+
+class Server:
+    """The server binary run in a fresh jail; stopped with SIGTERM."""
+
+    def __init__(self, *args):
+        self.jail = os.path.realpath(tempfile.mkdtemp(prefix="jail."))
+        self.log = open(os.path.join(os.path.dirname(self.jail), os.path.basename(self.jail) + ".log"), "w+")
+        self.proc = subprocess.Popen([os.environ["SERVER_BIN"], *args], cwd=self.jail,
+                                     stdout=self.log, stderr=subprocess.STDOUT)
+        deadline = time.time() + 10
+        while True:
+            try:
+                socket.create_connection(("127.0.0.1", PORT), timeout=1).close()
+                break
+            except OSError:
+                if self.proc.poll() is not None or time.time() > deadline:
+                    raise RuntimeError("server did not start:\n" + self.output())
+                time.sleep(0.05)
+
+    def path(self, rel=""):
+        return os.path.join(self.jail, rel)
+
+    def output(self):
+        self.log.flush()
+        self.log.seek(0)
+        return self.log.read()
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.send_signal(signal.SIGTERM)
+            try:
+                self.proc.wait(10)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+        self.log.close()
+        os.unlink(self.log.name)
+        shutil.rmtree(self.jail, ignore_errors=True)
+
+
+def eq(got, want, what=""):
+    if got != want:
+        raise AssertionError("%s: got %r, want %r" % (what or "value", got, want))
+
+
+def main(tests):
+    """Runs every test_* function with a server of its own; a test
+    taking a `server` argument gets it, one that takes none starts its
+    own."""
+    names = sorted(n for n in tests if n.startswith("test_"))
+    failed = 0
+    for name in names:
+        fn = tests[name]
+        wants = fn.__code__.co_argcount > 0
+        srv = Server() if wants else None
+        try:
+            fn(srv) if wants else fn()
+            print("ok   %s" % name)
+        except Exception:
+            failed += 1
+            print("FAIL %s" % name)
+            traceback.print_exc()
+            if srv:
+                print(srv.output()[-2000:])
+        finally:
+            if srv:
+                srv.stop()
+    sys.exit(1 if failed else 0)
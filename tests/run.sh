@@ -0,0 +1,24 @@
+#!/bin/sh
+# End-to-end checks: builds the server into a temporary directory and
+# runs every tests/test_*.py (or the ones named) against it. Each test
+# starts the server in a jail of its own on port 5000, which must be
+# free. Needs gcc and python3.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+top=$(dirname "$here")
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+cd "$top"
+gcc -O2 -pthread -o "$out/server" server.c delete_directory.c copy_tree.c find_tree.c \
+    du_index.c manifest.c sha256.c shaper.c buf_pool.c recv_pipe.c arena.c watch.c \
+    supervisor.c cas.c
+export SERVER_BIN="$out/server"
+
+[ $# -gt 0 ] || set -- "$here"/test_*.py
+status=0
+for t in "$@"; do
+    echo "== $(basename "$t")"
+    python3 "$t" || status=1
+done
+exit $status
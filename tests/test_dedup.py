@@ -0,0 +1,80 @@
+"""HASH offers: HAVE places a stored copy, SEND asks for data that must
+match the hash."""
+import os
+
+from lib import Conn, eq, main, sha
+
+
+def offer(c, name, data, hexdigest=None):
+    c.send("write_file\n%s\nHASH %d %s\n" % (name, len(data), hexdigest or sha(data)))
+    return c.line()
+
+
+def read(server, rel):
+    with open(server.path(rel), "rb") as f:
+        return f.read()
+
+
+def test_have_and_send(server):
+    c = Conn()
+    data = os.urandom(200000)
+    eq(offer(c, "first", data), "SEND")
+    c.send(b"SIZE %d\n" % len(data) + data)
+    eq(c.line(), "OK")
+    eq(offer(c, "second", data), "HAVE")
+    eq(c.line(), "OK")
+    eq(read(server, "second"), data, "placed copy")
+    # A plain upload of the same content is stored once as well.
+    eq(c.upload("third", data), "OK")
+    eq(offer(c, "fourth", data), "HAVE")
+    eq(c.line(), "OK")
+
+
+def test_data_must_match_offer(server):
+    c = Conn()
+    eq(c.upload("target", b"old"), "OK")
+    data = os.urandom(100000)
+    eq(offer(c, "target", data), "SEND")
+    other = os.urandom(len(data))
+    c.send(b"SIZE %d\n" % len(other) + other)
+    eq(c.line(), "FAIL")
+    eq(read(server, "target"), b"old", "target after a mismatch")
+    eq(c.cmd("spwd"), "/")
+
+
+def test_refusals_keep_stream_in_step(server):
+    c = Conn()
+    data = os.urandom(100000)
+    # Sparse bodies are never hashed.
+    eq(offer(c, "s", data), "SEND")
+    c.send(b"SPARSE %d 1\n0 %d\n" % (len(data), len(data)) + data)
+    eq(c.line(), "FAIL")
+    # A hash that does not parse cannot be checked.
+    eq(offer(c, "bad", data, "zz" * 32), "SEND")
+    c.send(b"SIZE %d\n" % len(data) + data)
+    eq(c.line(), "FAIL")
+    # Nor a name outside the jail.
+    eq(offer(c, "../escape", data), "SEND")
+    c.send(b"SIZE %d\n" % len(data) + data)
+    eq(c.line(), "FAIL")
+    eq(os.path.exists(os.path.join(os.path.dirname(server.jail), "escape")), False, "outside file")
+    eq(sorted(n for n in os.listdir(server.jail) if not n.startswith(".")), [], "jail contents")
+    eq(c.cmd("spwd"), "/")
+
+
+def test_damaged_store_object_is_not_placed(server):
+    c = Conn()
+    data = os.urandom(100000)
+    eq(c.upload("orig", data), "OK")
+    # The upload and its store object share an inode; change it behind
+    # the server's back.
+    with open(server.path("orig"), "r+b") as f:
+        f.write(b"\0" * 16)
+    eq(offer(c, "copy", data), "SEND")
+    c.send(b"SIZE %d\n" % len(data) + data)
+    eq(c.line(), "OK")
+    eq(read(server, "copy"), data, "uploaded copy")
+
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,47 @@
+"""An upload that breaks off never replaces or creates its target."""
+import os
+import time
+
+from lib import Conn, eq, main
+
+
+def leftovers(server):
+    return sorted(n for n in os.listdir(server.jail) if n.startswith(".f.") or n.startswith(".new."))
+
+
+def wait_clean(server):
+    deadline = time.time() + 5
+    while leftovers(server) and time.time() < deadline:
+        time.sleep(0.05)
+    eq(leftovers(server), [], "temporary files")
+
+
+def test_size_upload_cut_short(server):
+    c = Conn()
+    eq(c.upload("f", b"old"), "OK")
+    d = Conn()
+    d.send(b"write_file\nf\nSIZE %d\n" % (1 << 20) + os.urandom(100000))
+    d.close()
+    d = Conn()
+    d.send(b"write_file\nnew\nSIZE 1000\n" + b"x" * 10)
+    d.close()
+    wait_clean(server)
+    with open(server.path("f"), "rb") as fp:
+        eq(fp.read(), b"old", "target")
+    eq(os.path.exists(server.path("new")), False, "new target")
+    eq(c.cmd("spwd"), "/")
+
+
+def test_sparse_upload_cut_short(server):
+    c = Conn()
+    eq(c.upload("f", b"old"), "OK")
+    d = Conn()
+    d.send(b"write_file\nf\nSPARSE %d 2\n0 4096\n%d 4096\n" % (1 << 20, (1 << 20) - 4096) + os.urandom(5000))
+    d.close()
+    wait_clean(server)
+    with open(server.path("f"), "rb") as fp:
+        eq(fp.read(), b"old", "target")
+
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,59 @@
+"""sbatch: one reply per batch, with a vector per operation; smkdir
+stays in the jail."""
+import os
+import tempfile
+
+from lib import Conn, eq, main
+
+
+def batch(c, ops, stop=False):
+    c.send("sbatch %d%s\n" % (len(ops), " stop" if stop else "") + "".join(op + "\n" for op in ops))
+    return c.line()
+
+
+def test_vector(server):
+    c = Conn()
+    eq(c.upload("f", b"data"), "OK")
+    ops = ["smkdir a", "smkdir a/b", "scopy f a/b/g", "smkdir a", "srm f", "srm nope",
+           "smkdir c", "srm c", "smkdir d", "srename d a/b"]
+    reply = batch(c, ops)
+    # The second smkdir a fails, and so do srm of a missing file and a
+    # rename over a non-empty directory.
+    eq(reply, "BATCH 7 3 0001010001", "vector")
+    eq(os.path.isfile(server.path("a/b/g")), True, "copy in the batch")
+    eq(c.cmd("spwd"), "/")
+
+
+def test_stop(server):
+    c = Conn()
+    eq(batch(c, ["smkdir x", "srm missing", "smkdir y", "smkdir z"], stop=True), "BATCH 1 1 01--")
+    eq(os.path.exists(server.path("y")), False, "skipped after the failure")
+    # Every line was read: the session is in step.
+    eq(c.cmd("spwd"), "/")
+
+
+def test_bad_arguments(server):
+    c = Conn()
+    eq(c.cmd("sbatch -1"), "sbatch: bad arguments")
+    eq(c.cmd("sbatch 2 maybe"), "sbatch: bad arguments")
+    eq(batch(c, []), "BATCH 0 0 ")
+
+
+def test_smkdir_stays_in_jail(server):
+    c = Conn()
+    outside = tempfile.mkdtemp()
+    try:
+        rel = os.path.relpath(outside, server.jail)
+        for path in (rel + "/x", outside + "/x", "../x", ".manifest.q"):
+            eq(c.cmd("smkdir " + path), "Failed to create directory", path)
+            eq(batch(c, ["smkdir " + path]), "BATCH 0 1 1", path)
+        os.symlink(outside, server.path("link"))
+        eq(c.cmd("smkdir link/x"), "Failed to create directory", "through a symlink")
+        eq(os.listdir(outside), [], "outside dir")
+        eq(os.path.exists(os.path.join(os.path.dirname(server.jail), "x")), False, "next to the jail")
+    finally:
+        os.rmdir(outside)
+
+
+if __name__ == "__main__":
+    main(globals())
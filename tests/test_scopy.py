@@ -0,0 +1,61 @@
+"""scopy: server-side copies stay inside the jail."""
+import os
+import tempfile
+
+from lib import Conn, eq, main
+
+
+def test_copy_file_and_tree(server):
+    c = Conn()
+    data = os.urandom(200000)
+    eq(c.upload("a.bin", data), "OK")
+    eq(c.cmd("scopy a.bin b.bin"), "Copied")
+    with open(server.path("b.bin"), "rb") as f:
+        eq(f.read(), data, "copied file")
+    eq(c.cmd("smkdir src"), "Directory created")
+    eq(c.cmd("smkdir src/sub"), "Directory created")
+    eq(c.upload("src/sub/x", b"xyz"), "OK")
+    eq(c.cmd("scopy src dst"), "Copied")
+    with open(server.path("dst/sub/x"), "rb") as f:
+        eq(f.read(), b"xyz", "copied tree")
+
+
+def test_refuses_targets_outside(server):
+    c = Conn()
+    eq(c.upload("a", b"1"), "OK")
+    outside = tempfile.mkdtemp()
+    try:
+        eq(c.cmd("scopy a ../x"), "Copy failed")
+        eq(c.cmd("scopy a %s/x" % outside), "Copy failed")
+        eq(os.listdir(outside), [], "outside dir")
+    finally:
+        os.rmdir(outside)
+
+
+def test_merge_does_not_follow_symlinked_dir(server):
+    c = Conn()
+    outside = tempfile.mkdtemp()
+    try:
+        eq(c.cmd("smkdir src"), "Directory created")
+        eq(c.cmd("smkdir src/sub"), "Directory created")
+        eq(c.upload("src/sub/x", b"xyz"), "OK")
+        # Like cp, copying onto a directory copies into it: dst/src is
+        # merged, and its sub is a link out of the jail.
+        os.makedirs(server.path("dst/src"))
+        os.symlink(outside, server.path("dst/src/sub"))
+        eq(c.cmd("scopy src dst"), "Copy failed")
+        eq(os.listdir(outside), [], "outside dir")
+    finally:
+        os.rmdir(outside)
+
+
+def test_long_name(server):
+    c = Conn()
+    name = "n" * 250
+    eq(c.upload(name, b"long"), "OK")
+    eq(c.cmd("scopy %s %s" % (name, name[:-1] + "m")), "Copied")
+    eq(os.path.exists(server.path(name[:-1] + "m")), True, "copy with a 250-byte name")
+
+
+if __name__ == "__main__":
+    main(globals())
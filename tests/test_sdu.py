@@ -0,0 +1,91 @@
+"""sdu: the cached index agrees with a walk of the tree."""
+import os
+import stat
+
+from lib import Conn, Server, eq, main, sha
+
+
+def walk(root):
+    """bytes, files, dirs as du counts them: each inode once."""
+    size = files = dirs = 0
+    seen = set()
+    for top, ds, fs in os.walk(root):
+        ds[:] = [d for d in ds if not d.startswith(".")]
+        dirs += len(ds)
+        for f in fs:
+            if f.startswith("."):
+                continue
+            st = os.lstat(os.path.join(top, f))
+            if not stat.S_ISREG(st.st_mode):
+                continue
+            files += 1
+            if (st.st_dev, st.st_ino) not in seen:
+                seen.add((st.st_dev, st.st_ino))
+                size += st.st_size
+    return size, files, dirs
+
+
+def check(conns, server, rel):
+    size, files, dirs = walk(server.path(rel))
+    want = "%d bytes" % size
+    tail = "%d files, %d dirs" % (files, dirs)
+    for c in conns:
+        got = c.cmd("sdu " + rel)
+        if not got.startswith(want + " ") or not got.endswith(tail):
+            raise AssertionError("sdu %s: got %r, want %s ... %s" % (rel, got, want, tail))
+
+
+def test_follows_changes(server):
+    c = Conn()
+    eq(c.cmd("smkdir d"), "Directory created")
+    eq(c.cmd("smkdir d/e"), "Directory created")
+    eq(c.upload("d/a", os.urandom(5000)), "OK")
+    eq(c.upload("d/e/b", os.urandom(7000)), "OK")
+    check([c], server, "d")
+    eq(c.cmd("scopy d/a d/e/c"), "Copied")
+    # srename only replaces an existing target.
+    eq(c.cmd("smkdir d/f"), "Directory created")
+    eq(c.cmd("srename d/e d/f"), "Renamed")
+    check([c], server, "d")
+    eq(c.cmd("srm d/a"), "Deleted")
+    check([c], server, "d")
+    check([c], server, "d/f")
+
+
+def test_dedup_links_count_once(server):
+    c = Conn()
+    data = os.urandom(100000)
+    for d in ("a", "b"):
+        eq(c.cmd("smkdir " + d), "Directory created")
+    eq(c.upload("a/x", data), "OK")
+    c.send("write_file\nb/y\nHASH %d %s\n" % (len(data), sha(data)))
+    eq(c.line(), "HAVE")
+    eq(c.line(), "OK")
+    eq(os.stat(server.path("a/x")).st_ino, os.stat(server.path("b/y")).st_ino, "placed as a link")
+    for rel in (".", "a", "b"):
+        check([c], server, rel)
+    eq(c.cmd("srm a/x"), "Deleted")
+    check([c], server, ".")
+    check([c], server, "b")
+
+
+def test_workers_see_each_others_changes():
+    server = Server("--workers", "2")
+    try:
+        # Several connections, so both workers are among them.
+        conns = [Conn() for _ in range(8)]
+        eq(conns[0].cmd("smkdir w"), "Directory created")
+        eq(conns[1].cmd("smkdir w/sub"), "Directory created")
+        for i, c in enumerate(conns[2:5]):
+            eq(c.upload("w/sub/f%d" % i, os.urandom(3000 + i)), "OK")
+        eq(conns[5].upload("w/top", os.urandom(100)), "OK")
+        eq(conns[6].cmd("scopy w/top w/sub/copy"), "Copied")
+        check(conns, server, "w")
+        eq(conns[7].cmd("srm w/sub/f0"), "Deleted")
+        check(conns, server, "w")
+    finally:
+        server.stop()
+
+
+if __name__ == "__main__":
+    main(globals())
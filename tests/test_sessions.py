@@ -0,0 +1,44 @@
+"""Idle sessions cost little."""
+import resource
+
+from lib import Conn, eq, main
+
+
+def rss_kb(pid):
+    with open("/proc/%d/status" % pid) as f:
+        for l in f:
+            if l.startswith("VmRSS:"):
+                return int(l.split()[1])
+    return 0
+
+
+def stat_line(c, prefix):
+    c.send("sstat\n")
+    for l in c.until_end():
+        if l.startswith(prefix):
+            return l
+    raise AssertionError("no %r line" % prefix)
+
+
+def test_idle_sessions_are_cheap(server):
+    n = 400
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < n + 64:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, n + 64), hard))
+    probe = Conn()
+    eq(probe.cmd("spwd"), "/")
+    before = rss_kb(server.proc.pid)
+    idle = [Conn() for _ in range(n)]
+    line = stat_line(probe, "worker ")
+    if " %d sessions" % (n + 1) not in line:
+        raise AssertionError("sstat: %r" % line)
+    grown = rss_kb(server.proc.pid) - before
+    # An idle session is a small struct and a socket.
+    if grown * 1024 > n * 2048:
+        raise AssertionError("%d idle sessions grew RSS by %d kB" % (n, grown))
+    for c in idle:
+        c.close()
+
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,52 @@
+"""sfind: streamed results, filters and scancel."""
+import os
+
+from lib import Conn, eq, main
+
+
+def make_tree(server, dirs, files):
+    for d in range(dirs):
+        os.makedirs(server.path("t/d%d" % d))
+        for f in range(files):
+            with open(server.path("t/d%d/f%d.txt" % (d, f)), "wb") as fp:
+                fp.write(b"x" * f)
+
+
+def test_results_and_filters(server):
+    make_tree(server, 3, 4)
+    c = Conn()
+    c.send("sfind t -name f1.txt\n")
+    out = c.until_end()
+    eq(sorted(out[:-1]), ["t/d0/f1.txt", "t/d1/f1.txt", "t/d2/f1.txt"], "by name")
+    eq(out[-1], "END 3", "trailer")
+    c.send("sfind t -size +2\n")
+    eq(c.until_end()[-1], "END 3", "by size")
+    c.send("sfind t -limit 2\n")
+    eq(c.until_end()[-1], "END 2 limit", "limit")
+    eq(c.cmd("sfind ../.."), "sfind: bad path")
+
+
+def test_scancel(server):
+    make_tree(server, 50, 200)
+    c = Conn()
+    # Sent together: the search sees input waiting and stops at once.
+    c.send("sfind\nscancel\n")
+    out = c.until_end()
+    end = out[-1].split()
+    eq((end[0], end[2]), ("END", "cancelled"), "trailer")
+    if int(end[1]) >= 50 * 201:
+        raise AssertionError("cancelled search still listed everything")
+    # scancel itself gets no reply, so the next command is in step.
+    eq(c.cmd("spwd"), "/")
+
+
+def test_late_scancel(server):
+    c = Conn()
+    c.send("sfind\n")
+    eq(c.until_end()[-1], "END 0")
+    c.send("scancel\n")
+    eq(c.cmd("spwd"), "/")
+
+
+if __name__ == "__main__":
+    main(globals())
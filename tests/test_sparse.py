@@ -0,0 +1,52 @@
+"""SPARSE uploads: only the data extents travel; the rest are holes."""
+import os
+
+from lib import Conn, eq, main
+
+
+def sparse(c, name, size, extents):
+    """extents: [(offset, bytes)]"""
+    head = "write_file\n%s\nSPARSE %d %d\n" % (name, size, len(extents))
+    head += "".join("%d %d\n" % (off, len(data)) for off, data in extents)
+    c.send(head.encode() + b"".join(data for _, data in extents))
+    return c.line()
+
+
+def test_extents_and_holes(server):
+    c = Conn()
+    size = 64 << 20
+    a, b = os.urandom(4096), os.urandom(8192)
+    eq(sparse(c, "img", size, [(0, a), (size - 8192, b)]), "OK")
+    st = os.stat(server.path("img"))
+    eq(st.st_size, size, "size")
+    with open(server.path("img"), "rb") as f:
+        eq(f.read(4096), a, "first extent")
+        eq(f.read(4096), bytes(4096), "hole")
+        f.seek(size - 8192)
+        eq(f.read(), b, "last extent")
+    if st.st_blocks * 512 > 1 << 20:
+        raise AssertionError("holes were written: %d bytes allocated" % (st.st_blocks * 512))
+
+
+def test_all_hole(server):
+    c = Conn()
+    eq(sparse(c, "empty", 1 << 20, []), "OK")
+    eq(os.stat(server.path("empty")).st_size, 1 << 20, "size")
+
+
+def test_bad_extents_keep_stream_in_step(server):
+    c = Conn()
+    eq(c.upload("keep", b"original"), "OK")
+    # Overlapping extents, and one past the end: the data is read and
+    # dropped, the target left alone.
+    eq(sparse(c, "keep", 100, [(0, b"x" * 10), (5, b"y" * 10)]), "FAIL")
+    eq(sparse(c, "keep", 100, [(95, b"z" * 10)]), "FAIL")
+    with open(server.path("keep"), "rb") as f:
+        eq(f.read(), b"original", "target")
+    eq(c.cmd("spwd"), "/")
+    c.send("write_file\nx\nSPARSE 100 99999999\n")
+    eq(c.line(), "bad size")
+
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,44 @@
+"""srate: uploads are held to the session rate; control commands are not."""
+import os
+import threading
+import time
+
+from lib import Conn, eq, main
+
+
+def test_session_rate_and_control_first(server):
+    bulk, ctl = Conn(), Conn()
+    eq(bulk.cmd("srate session 200k"), "Rate set")
+    data = os.urandom(600 * 1024)
+    result = {}
+
+    def upload():
+        t = time.time()
+        result["reply"] = bulk.upload("slow.bin", data)
+        result["secs"] = time.time() - t
+
+    th = threading.Thread(target=upload)
+    th.start()
+    time.sleep(0.3)
+    t = time.time()
+    eq(ctl.cmd("spwd"), "/")
+    if time.time() - t > 0.5:
+        raise AssertionError("control command waited %.2fs behind the upload" % (time.time() - t))
+    th.join()
+    eq(result["reply"], "OK")
+    # 600k at 200k/s, less whatever the bucket held at the start.
+    if result["secs"] < 1.5:
+        raise AssertionError("upload took %.2fs at 200k/s" % result["secs"])
+    with open(server.path("slow.bin"), "rb") as f:
+        eq(f.read(), data, "throttled upload")
+
+
+def test_usage(server):
+    c = Conn()
+    eq(c.cmd("srate session fast"), "usage: srate global|session|default <rate>")
+    eq(c.cmd("srate bogus 1k"), "usage: srate global|session|default <rate>")
+    eq(c.cmd("srate session 0"), "Rate set")
+
+
+if __name__ == "__main__":
+    main(globals())
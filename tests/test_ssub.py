@@ -0,0 +1,42 @@
+"""ssub: change events are pushed to an idle subscriber."""
+import os
+import select
+
+from lib import Conn, eq, main
+
+
+def pending(c, timeout):
+    return bool(select.select([c.s], [], [], timeout)[0])
+
+
+def test_events_while_idle(server):
+    sub, other = Conn(), Conn()
+    eq(other.cmd("smkdir w"), "Directory created")
+    eq(sub.cmd("ssub -r w"), "Subscribed /w (1 dirs)")
+    eq(other.cmd("smkdir w/d"), "Directory created")
+    eq(sub.line(), "EVENT created d %d /w/d" % os.stat(server.path("w/d")).st_size)
+    eq(other.upload("w/d/f", b"12345"), "OK")
+    eq(sub.line(), "EVENT created f 5 /w/d/f")
+    eq(other.cmd("srm w/d/f"), "Deleted")
+    eq(sub.line(), "EVENT deleted - 0 /w/d/f")
+    # Events never split a reply: the next line is the command's own.
+    eq(sub.cmd("spwd"), "/")
+
+
+def test_unsubscribe(server):
+    sub, other = Conn(), Conn()
+    eq(sub.cmd("ssub").startswith("Subscribed "), True, "subscribe")
+    eq(sub.cmd("sunsub"), "Unsubscribed")
+    eq(other.cmd("smkdir quiet"), "Directory created")
+    if pending(sub, 1.5):
+        raise AssertionError("event after sunsub: %r" % sub.line())
+    eq(sub.cmd("spwd"), "/")
+
+
+def test_bad_path(server):
+    c = Conn()
+    eq(c.cmd("ssub ../.."), "ssub: bad path")
+
+
+if __name__ == "__main__":
+    main(globals())
@@ -0,0 +1,72 @@
+"""ssync and the manifest behind it."""
+import os
+
+from lib import Conn, eq, main, sha
+
+
+def ssync(c, files, d=""):
+    """files: {path: bytes}. Returns (sorted reply lines, END line)."""
+    c.send("ssync %d%s\n" % (len(files), " " + d if d else ""))
+    for p, data in files.items():
+        c.send("%d %s %s\n" % (len(data), sha(data), p))
+    out = c.until_end()
+    return sorted(out[:-1]), out[-1]
+
+
+def manifest_entries(c):
+    c.send("sstat\n")
+    out = c.until_end()
+    for l in out:
+        if l.startswith("manifest entries:"):
+            return int(l.split()[-1])
+    raise AssertionError("no manifest line in %r" % out)
+
+
+def test_diff(server):
+    c = Conn()
+    a, b, x = os.urandom(1000), os.urandom(2000), os.urandom(10)
+    eq(c.cmd("smkdir s"), "Directory created")
+    eq(c.upload("s/a", a), "OK")
+    eq(c.upload("s/b", b), "OK")
+    eq(c.upload("s/extra", x), "OK")
+    changed = bytearray(b)
+    changed[0] ^= 1
+    lines, end = ssync(c, {"a": a, "b": bytes(changed), "new": b"n"}, "s")
+    eq(lines, ["DELETE extra", "SEND b", "SEND new"], "diff")
+    eq(end, "END 2 1", "trailer")
+    lines, end = ssync(c, {"a": a, "b": b, "extra": x}, "s")
+    eq((lines, end), ([], "END 0 0"), "in sync")
+
+
+def test_refuses_paths_outside(server):
+    c = Conn()
+    c.send("ssync 1\n1 %s ../x\n" % sha(b"1"))
+    eq(c.line(), "ssync: bad manifest")
+    eq(c.cmd("ssync 0 .."), "ssync: bad path")
+    eq(c.cmd("spwd"), "/")
+
+
+def test_manifest_follows_rm_and_rename(server):
+    c = Conn()
+    eq(c.cmd("smkdir m"), "Directory created")
+    eq(c.upload("m/a", b"a" * 100), "OK")
+    eq(c.upload("m/b", b"b" * 100), "OK")
+    eq(c.upload("m/c", b"c" * 100), "OK")
+    eq(manifest_entries(c), 3, "after uploads")
+    eq(c.cmd("srm m/a"), "Deleted")
+    eq(manifest_entries(c), 2, "after srm")
+    # Replacing b with c leaves one entry, under b.
+    eq(c.cmd("srename m/c m/b"), "Renamed")
+    eq(manifest_entries(c), 1, "after srename")
+    lines, end = ssync(c, {"b": b"c" * 100}, "m")
+    eq((lines, end), ([], "END 0 0"), "renamed entry")
+    eq(c.cmd("smkdir n"), "Directory created")
+    eq(c.cmd("srename m n"), "Renamed")
+    lines, end = ssync(c, {"b": b"c" * 100}, "n")
+    eq((lines, end), ([], "END 0 0"), "renamed tree")
+    eq(c.cmd("srm n"), "Deleted")
+    eq(manifest_entries(c), 0, "after removing the tree")
+
+
+if __name__ == "__main__":
+    main(globals())
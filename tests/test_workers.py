@@ -0,0 +1,110 @@
+"""Supervisor mode: reloads keep established sessions; each session
+keeps its own directory while sharing a worker with others."""
+import os
+import signal
+import subprocess
+import threading
+import time
+
+from lib import Conn, Server, eq, main
+
+
+def workers(server):
+    out = subprocess.run(["pgrep", "-P", str(server.proc.pid)], capture_output=True, text=True).stdout
+    return sorted(int(p) for p in out.split())
+
+
+def wait_for(cond, what, secs=10):
+    deadline = time.time() + secs
+    while not cond():
+        if time.time() > deadline:
+            raise AssertionError("timed out waiting for " + what)
+        time.sleep(0.05)
+
+
+def test_reload_keeps_sessions():
+    server = Server("--workers", "2")
+    try:
+        wait_for(lambda: len(workers(server)) == 2, "two workers")
+        seen = set(workers(server))
+        conns = [Conn() for _ in range(4)]
+        eq(conns[0].cmd("smkdir d"), "Directory created")
+        for c in conns:
+            eq(c.cmd("scd d"), "Directory changed")
+        for sig in (signal.SIGHUP, signal.SIGUSR2):
+            server.proc.send_signal(sig)
+            wait_for(lambda: len(set(workers(server)) - seen) == 2, "new workers")
+            current = sorted(set(workers(server)) - seen)
+            seen |= set(current)
+            for c in conns:
+                eq(c.cmd("spwd"), "/d", "established session")
+            eq(Conn().cmd("spwd"), "/", "new session")
+        for c in conns:
+            c.close()
+        # With their last session gone the retired workers exit.
+        wait_for(lambda: workers(server) == current, "retired workers to exit")
+        server.proc.send_signal(signal.SIGTERM)
+        eq(server.proc.wait(10), 0, "supervisor exit status")
+    finally:
+        server.stop()
+
+
+def test_stop_closes_idle_sessions():
+    server = Server("--workers", "1")
+    try:
+        c = Conn()
+        eq(c.cmd("spwd"), "/")
+        t = time.time()
+        server.proc.send_signal(signal.SIGTERM)
+        eq(c.s.recv(10), b"", "idle session closed")
+        if time.time() - t > 3:
+            raise AssertionError("stop took %.1fs" % (time.time() - t))
+        server.proc.wait(10)
+    finally:
+        server.stop()
+
+
+def test_sessions_keep_their_directories(server):
+    c0 = Conn()
+    for i in range(8):
+        eq(c0.cmd("smkdir d%d" % i), "Directory created")
+    errors = []
+
+    def run(i):
+        try:
+            c = Conn()
+            eq(c.cmd("scd d%d" % i), "Directory changed")
+            for _ in range(50):
+                eq(c.cmd("spwd"), "/d%d" % i)
+                eq(c.cmd("sls"), "(empty)")
+            eq(c.cmd("scd .."), "Directory changed")
+            eq(c.cmd("spwd"), "/")
+        except Exception as e:
+            errors.append(e)
+
+    ts = [threading.Thread(target=run, args=(i,)) for i in range(8)]
+    for t in ts:
+        t.start()
+    for t in ts:
+        t.join()
+    if errors:
+        raise errors[0]
+
+
+def test_parallel_uploads(server):
+    data = os.urandom(8 << 20)
+    replies = []
+    ts = [threading.Thread(target=lambda i=i: replies.append(Conn().upload("u%d" % i, data)))
+          for i in range(6)]
+    for t in ts:
+        t.start()
+    for t in ts:
+        t.join()
+    eq(replies, ["OK"] * 6)
+    for i in range(6):
+        with open(server.path("u%d" % i), "rb") as f:
+            eq(f.read() == data, True, "upload %d" % i)
+
+
+if __name__ == "__main__":
+    main(globals())
@@ -35,6 +35,10 @@
   #include <sys/types.h>
   #include <sys/socket.h>
   #include <netinet/in.h>
+  #include <signal.h>
+  #ifdef __linux__
+  #include <sys/sendfile.h>
+  #endif
   typedef int sock_t;
   #define INVALID_SOCKET (-1)
   #define CLOSESOCK close
@@ -43,13 +47,40 @@
 #endif
 
 // Adjust if your server uses a different command for listing
-#define SERVER_LS_CMD "sls"   // change to "ls" if needed
-#define SERVER_PWD_CMD "pwd"
-#define SERVER_CD_CMD  "cd"
+#define SERVER_LS_CMD "slist"
+#define SERVER_PWD_CMD "spwd"
+#define SERVER_CD_CMD  "scd"
 #define SERVER_MKDIR_CMD "mkdir"
 #define SERVER_RM_CMD "rm"
 #define SERVER_RENAME_CMD "rename"
-#define SERVER_PUT_CMD "put"  // name then bytes then EOF
+#define SERVER_PUT_CMD "write_file"  // name line, "SIZE <n>", n bytes; replies OK or FAIL
+#define SERVER_SUB_CMD "ssub"  // pushes "EVENT ..." lines for a directory
+
+// Server listings are cached per path and shown at once on revisits while
+// a revalidation runs. Subdirectories of the current view are prefetched
+// once the connection has been idle for PREFETCH_IDLE_MS.
+#define LIST_CACHE_MAX_BYTES (4 * 1024 * 1024)
+#define PREFETCH_MAX_DIRS 32
+#define PREFETCH_IDLE_MS 300
+
+// Uploads go out with sendfile where available, otherwise through a
+// buffer this large so a fast link is not limited by syscalls.
+#define UPLOAD_BUF_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    gchar *name;
+    char type;              // 'd', 'f', 'l' or 'o', as sent by slist
+    gint64 size;
+} SrvItem;
+
+typedef struct {
+    gint ref;
+    gchar *path;            // absolute server path, as spwd prints it
+    GPtrArray *items;       // SrvItem*
+    gint64 mtime_ns;        // 0: the server cannot vouch for it, re-list
+    gsize bytes;            // approximate memory held, for the cache cap
+    GList lru_link;         // position in App.lru while cached
+} Listing;
 
 typedef struct {
     GtkWidget *tv_server;
@@ -63,7 +94,23 @@ typedef struct {
     GMutex ui_mutex;
 
     sock_t sock;
+    struct sockaddr_in srv_addr;    // uploads open their own connection here
     gchar cwd_local[1024];
+
+    GMutex sock_mutex;      // held for a whole request/response exchange
+    GAsyncQueue *replies;   // reply lines from the reader thread
+    gint64 last_user_io;    // end of the last user exchange (sock_mutex)
+    gchar *sub_path;        // directory the server pushes events for (sock_mutex)
+
+    GMutex cache_mutex;
+    GHashTable *cache;      // path -> Listing*
+    GQueue lru;             // Listing*, most recently used first
+    gsize cache_bytes;
+    gchar *srv_cwd;         // path shown in the server pane (UI thread)
+
+    GMutex pf_mutex;
+    GCond pf_cond;
+    GQueue pf_queue;        // gchar* paths waiting to be prefetched
 } App;
 
 enum { COL_NAME = 0, COL_TYPE, COL_SIZE, N_COLS };
@@ -103,96 +150,526 @@ static void store_add(GtkListStore *s, const char *name, const char *type, const
 }
 
 /* ---- Networking helpers ---- */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// send() may take only part of the buffer; keep going until all is out.
+static int send_all(sock_t s, const char *p, gint64 n)
+{
+    while (n > 0) {
+        int chunk = n > (1 << 30) ? (1 << 30) : (int)n;
+        int r = (int)send(s, p, chunk, MSG_NOSIGNAL);
+        if (r < 0 && sock_err() == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
 static int sendf(sock_t s, const char *fmt, ...)
 {
     char buf[1024];
     va_list ap; va_start(ap, fmt);
     int n = vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
-    if (n < 0) return -1;
-    if (send(s, buf, n, 0) != n) return -1;
-    return 0;
+    if (n < 0 || n >= (int)sizeof(buf)) return -1;
+    return send_all(s, buf, n);
 }
 
-static int recv_line(sock_t s, char *out, size_t cap, int timeout_ms)
+// Pushed after the last reply line once the connection is gone.
+static char conn_closed_mark;
+#define CONN_CLOSED ((gpointer)&conn_closed_mark)
+
+// Next reply line, as split off by reader_thread; the caller holds
+// sock_mutex. Returns -1 once the connection has closed.
+static int recv_line(App *app, char *out, size_t cap)
 {
-    size_t pos = 0;
-    long waited = 0;
-    while (pos+1 < cap) {
-        char c;
-        int r = recv(s, &c, 1, 0);
-        if (r == 1) {
-            if (c == '\\n') break;
-            out[pos++] = c;
-        } else if (r == 0) {
-            break; // connection closed
-        } else {
-#ifdef _WIN32
-            int e = WSAGetLastError();
-            if (e == WSAEWOULDBLOCK) { sleep_ms(5); waited+=5; if (waited>=timeout_ms) break; continue; }
-#else
-            if (errno == EAGAIN || errno == EWOULDBLOCK) { usleep(5000); waited+=5; if (waited>=timeout_ms) break; continue; }
-#endif
-            return -1;
+    gpointer l = g_async_queue_pop(app->replies);
+    if (l == CONN_CLOSED) {
+        g_async_queue_push(app->replies, CONN_CLOSED);
+        out[0] = 0;
+        return -1;
+    }
+    g_strlcpy(out, l, cap);
+    g_free(l);
+    return (int)strlen(out);
+}
+
+/* ---- Server listing cache ---- */
+static void srv_item_free(gpointer p)
+{
+    SrvItem *it = p;
+    g_free(it->name);
+    g_free(it);
+}
+
+static Listing* listing_new(const char *path)
+{
+    Listing *l = g_new0(Listing, 1);
+    l->ref = 1;
+    l->path = g_strdup(path);
+    l->items = g_ptr_array_new_with_free_func(srv_item_free);
+    l->bytes = sizeof(*l) + strlen(path) + 1;
+    l->lru_link.data = l;
+    return l;
+}
+
+static Listing* listing_ref(Listing *l)
+{
+    g_atomic_int_inc(&l->ref);
+    return l;
+}
+
+static void listing_unref(gpointer p)
+{
+    Listing *l = p;
+    if (!l || !g_atomic_int_dec_and_test(&l->ref)) return;
+    g_ptr_array_free(l->items, TRUE);
+    g_free(l->path);
+    g_free(l);
+}
+
+// Returns a new reference to the cached listing, marking it recently used.
+static Listing* cache_get(App *app, const char *path)
+{
+    g_mutex_lock(&app->cache_mutex);
+    Listing *l = g_hash_table_lookup(app->cache, path);
+    if (l) {
+        g_queue_unlink(&app->lru, &l->lru_link);
+        g_queue_push_head_link(&app->lru, &l->lru_link);
+        listing_ref(l);
+    }
+    g_mutex_unlock(&app->cache_mutex);
+    return l;
+}
+
+static gboolean cache_contains(App *app, const char *path)
+{
+    g_mutex_lock(&app->cache_mutex);
+    gboolean r = g_hash_table_contains(app->cache, path);
+    g_mutex_unlock(&app->cache_mutex);
+    return r;
+}
+
+static void cache_drop_locked(App *app, Listing *l)
+{
+    g_queue_unlink(&app->lru, &l->lru_link);
+    app->cache_bytes -= l->bytes;
+    g_hash_table_remove(app->cache, l->path);   // drops the cache's reference
+}
+
+// Prefetched listings enter at the cold end of the LRU, so speculation
+// never evicts a directory the user actually visited.
+static void cache_put(App *app, Listing *l, gboolean speculative)
+{
+    g_mutex_lock(&app->cache_mutex);
+    Listing *old = g_hash_table_lookup(app->cache, l->path);
+    if (old) cache_drop_locked(app, old);
+    g_hash_table_insert(app->cache, l->path, listing_ref(l));
+    if (speculative) g_queue_push_tail_link(&app->lru, &l->lru_link);
+    else g_queue_push_head_link(&app->lru, &l->lru_link);
+    app->cache_bytes += l->bytes;
+    while (app->cache_bytes > LIST_CACHE_MAX_BYTES && app->lru.length > 1) {
+        GList *victim = app->lru.tail;
+        if (victim->data == l && !speculative) victim = victim->prev;
+        gboolean self = victim->data == l;
+        cache_drop_locked(app, victim->data);
+        if (self) break;
+    }
+    g_mutex_unlock(&app->cache_mutex);
+}
+
+// Sends "slist [-t mtime] <path>" and reads the reply; the caller holds
+// sock_mutex. Returns 1 if known_mtime is still current, 0 with *out set
+// to a fresh listing, -1 on error.
+static int fetch_listing(App *app, const char *path, gint64 known_mtime, Listing **out)
+{
+    int rc;
+    if (known_mtime > 0)
+        rc = sendf(app->sock, SERVER_LS_CMD " -t %" G_GINT64_FORMAT " %s\n", known_mtime, path);
+    else
+        rc = sendf(app->sock, SERVER_LS_CMD " %s\n", path);
+    if (rc != 0) return -1;
+    Listing *l = listing_new(path);
+    char line[1024];
+    while (recv_line(app, line, sizeof(line)) >= 0) {
+        if (strncmp(line, "SAME ", 5) == 0) { listing_unref(l); return 1; }
+        if (strncmp(line, "ERR", 3) == 0) break;
+        if (strncmp(line, "END ", 4) == 0) {
+            unsigned long n;
+            long long mt;
+            if (sscanf(line + 4, "%lu %lld", &n, &mt) != 2) break;
+            l->mtime_ns = mt;
+            *out = l;
+            return 0;
+        }
+        char type;
+        long long size;
+        int off = 0;
+        if (sscanf(line, "%c %lld %n", &type, &size, &off) != 2 || !off) continue;
+        SrvItem *it = g_new(SrvItem, 1);
+        it->name = g_strdup(line + off);
+        it->type = type;
+        it->size = size;
+        g_ptr_array_add(l->items, it);
+        l->bytes += sizeof(*it) + sizeof(gpointer) + strlen(it->name) + 1;
+    }
+    listing_unref(l);
+    return -1;
+}
+
+static gchar* child_path(const char *dir, const char *name)
+{
+    size_t n = strlen(dir);
+    return g_strconcat(dir, (n && dir[n-1] == '/') ? "" : "/", name, NULL);
+}
+
+// Queues the subdirectories of a listing for prefetch, replacing what was
+// queued for the previous view.
+static void prefetch_children(App *app, const Listing *l)
+{
+    g_mutex_lock(&app->pf_mutex);
+    gchar *old;
+    while ((old = g_queue_pop_head(&app->pf_queue))) g_free(old);
+    for (guint i = 0; i < l->items->len && app->pf_queue.length < PREFETCH_MAX_DIRS; i++) {
+        SrvItem *it = g_ptr_array_index(l->items, i);
+        if (it->type == 'd') g_queue_push_tail(&app->pf_queue, child_path(l->path, it->name));
+    }
+    g_cond_signal(&app->pf_cond);
+    g_mutex_unlock(&app->pf_mutex);
+}
+
+static gpointer prefetch_thread(gpointer user)
+{
+    App *app = (App*)user;
+    for (;;) {
+        g_mutex_lock(&app->pf_mutex);
+        while (g_queue_is_empty(&app->pf_queue)) g_cond_wait(&app->pf_cond, &app->pf_mutex);
+        gchar *path = g_queue_pop_head(&app->pf_queue);
+        g_mutex_unlock(&app->pf_mutex);
+        if (cache_contains(app, path)) { g_free(path); continue; }
+
+        // User requests always go first: wait until the socket is free
+        // and nothing user-initiated happened for PREFETCH_IDLE_MS.
+        for (;;) {
+            if (g_mutex_trylock(&app->sock_mutex)) {
+                gint64 idle = g_get_monotonic_time() - app->last_user_io;
+                if (idle >= PREFETCH_IDLE_MS * 1000) break;
+                g_mutex_unlock(&app->sock_mutex);
+                g_usleep((gulong)(PREFETCH_IDLE_MS * 1000 - idle));
+            } else {
+                g_usleep(50 * 1000);
+            }
+        }
+        Listing *l = NULL;
+        if (fetch_listing(app, path, 0, &l) == 0) {
+            cache_put(app, l, TRUE);
+            listing_unref(l);
         }
+        g_mutex_unlock(&app->sock_mutex);
+        g_free(path);
     }
-    out[pos] = 0;
-    return (int)pos;
+    return NULL;
 }
 
+/* ---- Server pane ---- */
 typedef struct {
     App *app;
-} RefreshSrvCtx;
+    Listing *listing;       // reference owned by the view
+    const char *note;
+} SrvView;
+
+static const char* item_type_name(char type)
+{
+    switch (type) {
+        case 'd': return "dir";
+        case 'f': return "file";
+        case 'l': return "link";
+        default:  return "";
+    }
+}
 
+// Moves the server pane to the listing's path and shows it.
 static gboolean ui_update_srv_list(gpointer data)
 {
-    // data is a gchar** array: lines terminated by NULL
-    gpointer *arr = data;
-    App *app = arr[0];
-    char **lines = (char**)arr[1];
+    SrvView *v = data;
+    App *app = v->app;
+    Listing *l = v->listing;
 
+    g_free(app->srv_cwd);
+    app->srv_cwd = g_strdup(l->path);
     store_clear(app->store_srv);
-    for (char **p = lines; p && *p; ++p) {
-        if (**p == 0) continue;
-        store_add(app->store_srv, *p, "", "");
+    for (guint i = 0; i < l->items->len; i++) {
+        SrvItem *it = g_ptr_array_index(l->items, i);
+        char sz[32] = "";
+        if (it->type == 'f') snprintf(sz, sizeof(sz), "%" G_GINT64_FORMAT, it->size);
+        store_add(app->store_srv, it->name, item_type_name(it->type), sz);
     }
-    status_msg(app, "Server listed %d items", lines ? g_strv_length(lines) : 0);
-    if (lines) g_strfreev(lines);
-    g_free(arr);
+    status_msg(app, "Server %s: %u items%s", l->path, l->items->len, v->note);
+    listing_unref(l);
+    g_free(v);
     return FALSE;
 }
 
-static gpointer refresh_server_thread(gpointer user)
+static void post_listing(App *app, Listing *l, const char *note)
 {
-    App *app = (App*)user;
-    // Request listing
-    sendf(app->sock, SERVER_LS_CMD "\\n");
-    // Read lines until blank read or timeout accumulation
-    GPtrArray *a = g_ptr_array_new_with_free_func(g_free);
+    SrvView *v = g_new(SrvView, 1);
+    v->app = app;
+    v->listing = listing_ref(l);
+    v->note = note;
+    g_idle_add(ui_update_srv_list, v);
+}
 
-    for (;;) {
-        char line[1024];
-        int n = recv_line(app->sock, line, sizeof(line), 500);
-        if (n <= 0) break;
-        g_ptr_array_add(a, g_strdup(line));
-        if (a->len > 10000) break; // safety
-        // Heuristic: stop if server sends END
-        if (g_strcmp0(line, "END") == 0) break;
-    }
-    g_ptr_array_add(a, NULL);
-    gpointer *pack = g_new0(gpointer, 2);
-    pack[0] = app;
-    pack[1] = a->pdata; // ownership of vector
-    // do not free a, transfer its data vector; avoid g_ptr_array_free(a, TRUE)
-    g_idle_add(ui_update_srv_list, pack);
-    // free the container but not data
-    g_ptr_array_free(a, FALSE);
+typedef struct {
+    App *app;
+    gchar *msg;
+} StatusMsg;
+
+static gboolean ui_status(gpointer data)
+{
+    StatusMsg *m = data;
+    status_msg(m->app, "%s", m->msg);
+    g_free(m->msg);
+    g_free(m);
+    return FALSE;
+}
+
+static void post_status(App *app, const char *fmt, ...)
+{
+    StatusMsg *m = g_new(StatusMsg, 1);
+    va_list ap; va_start(ap, fmt);
+    m->app = app;
+    m->msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    g_idle_add(ui_status, m);
+}
+
+typedef struct {
+    App *app;
+    gchar *cd_arg;          // NULL: list the current directory
+    gboolean force;         // skip revalidation, fetch the full listing
+} SrvRequest;
+
+// Optional cd, then spwd and a listing. A cached listing of the target is
+// shown before the revalidating slist goes out; "SAME" keeps it.
+static gpointer srv_request_thread(gpointer user)
+{
+    SrvRequest *rq = user;
+    App *app = rq->app;
+    Listing *cached = NULL, *fresh = NULL, *shown = NULL;
+    char line[1024];
+
+    g_mutex_lock(&app->sock_mutex);
+    app->last_user_io = g_get_monotonic_time();
+    if (rq->cd_arg) {
+        if (sendf(app->sock, SERVER_CD_CMD " %s\n", rq->cd_arg) != 0 ||
+            recv_line(app, line, sizeof(line)) < 0 || strcmp(line, "Directory changed") != 0) {
+            post_status(app, "cd %s failed", rq->cd_arg);
+            goto out;
+        }
+    }
+    if (sendf(app->sock, SERVER_PWD_CMD "\n") != 0 || recv_line(app, line, sizeof(line)) <= 0) {
+        post_status(app, "Server connection lost");
+        goto out;
+    }
+    // Subscribe before listing: a change racing the listing then shows up
+    // as an event instead of being lost.
+    if (g_strcmp0(app->sub_path, line) != 0) {
+        char reply[256];
+        g_free(app->sub_path);
+        app->sub_path = NULL;
+        if (sendf(app->sock, SERVER_SUB_CMD " %s\n", line) == 0 &&
+            recv_line(app, reply, sizeof(reply)) >= 0 && strncmp(reply, "Subscribed", 10) == 0)
+            app->sub_path = g_strdup(line);
+    }
+    if ((cached = cache_get(app, line)) && !rq->force)
+        post_listing(app, cached, " (cached)");
+    int rc = fetch_listing(app, line, (cached && !rq->force) ? cached->mtime_ns : 0, &fresh);
+    if (rc == 1) {
+        shown = cached;
+        post_status(app, "Server %s: %u items (up to date)", line, cached->items->len);
+    } else if (rc == 0) {
+        shown = fresh;
+        cache_put(app, fresh, FALSE);
+        post_listing(app, fresh, "");
+    } else {
+        post_status(app, "Listing %s failed", line);
+    }
+out:
+    app->last_user_io = g_get_monotonic_time();
+    g_mutex_unlock(&app->sock_mutex);
+    if (shown) prefetch_children(app, shown);
+    listing_unref(cached);
+    listing_unref(fresh);
+    g_free(rq->cd_arg);
+    g_free(rq);
     return NULL;
 }
 
-static void refresh_server(App *app)
+static void server_request(App *app, const char *cd_arg, gboolean force)
+{
+    SrvRequest *rq = g_new(SrvRequest, 1);
+    rq->app = app;
+    rq->cd_arg = g_strdup(cd_arg);
+    rq->force = force;
+    g_thread_unref(g_thread_new("srv-request", srv_request_thread, rq));
+}
+
+static void refresh_server(App *app, gboolean force)
 {
-    g_thread_new("srv-refresh", refresh_server_thread, app);
+    server_request(app, NULL, force);
+}
+
+/* ---- Pushed change events ---- */
+static void split_server_path(const char *path, gchar **dir, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    *name = slash ? slash + 1 : path;
+    *dir = (!slash || slash == path) ? g_strdup("/") : g_strndup(path, (gsize)(slash - path));
+}
+
+// Cached listings are shared with views and threads, so a change makes
+// a modified copy. The old mtime is kept: the directory did change, so
+// the next revalidation will fetch the full listing anyway.
+static void cache_apply(App *app, const char *dir, const char *name, char type, gint64 size, gboolean remove)
+{
+    Listing *old = cache_get(app, dir);
+    if (!old) return;
+    Listing *l = listing_new(dir);
+    l->mtime_ns = old->mtime_ns;
+    gboolean found = FALSE;
+    for (guint i = 0; i < old->items->len; i++) {
+        SrvItem *it = g_ptr_array_index(old->items, i);
+        gboolean match = strcmp(it->name, name) == 0;
+        if (match) found = TRUE;
+        if (match && remove) continue;
+        SrvItem *c = g_new(SrvItem, 1);
+        c->name = g_strdup(it->name);
+        c->type = match ? type : it->type;
+        c->size = match ? size : it->size;
+        g_ptr_array_add(l->items, c);
+        l->bytes += sizeof(*c) + sizeof(gpointer) + strlen(c->name) + 1;
+    }
+    if (!found && !remove) {
+        SrvItem *c = g_new(SrvItem, 1);
+        c->name = g_strdup(name);
+        c->type = type;
+        c->size = size;
+        g_ptr_array_add(l->items, c);
+        l->bytes += sizeof(*c) + sizeof(gpointer) + strlen(c->name) + 1;
+    }
+    cache_put(app, l, FALSE);
+    listing_unref(l);
+    listing_unref(old);
+}
+
+static void cache_forget(App *app, const char *path)
+{
+    g_mutex_lock(&app->cache_mutex);
+    Listing *l = g_hash_table_lookup(app->cache, path);
+    if (l) cache_drop_locked(app, l);
+    g_mutex_unlock(&app->cache_mutex);
+}
+
+static void store_apply(App *app, const char *name, char type, gint64 size, gboolean remove)
+{
+    GtkTreeModel *m = GTK_TREE_MODEL(app->store_srv);
+    GtkTreeIter it;
+    char sz[32] = "";
+    if (type == 'f') snprintf(sz, sizeof(sz), "%" G_GINT64_FORMAT, size);
+    for (gboolean ok = gtk_tree_model_get_iter_first(m, &it); ok; ok = gtk_tree_model_iter_next(m, &it)) {
+        gchar *n = NULL;
+        gtk_tree_model_get(m, &it, COL_NAME, &n, -1);
+        gboolean match = g_strcmp0(n, name) == 0;
+        g_free(n);
+        if (!match) continue;
+        if (remove) gtk_list_store_remove(app->store_srv, &it);
+        else gtk_list_store_set(app->store_srv, &it, COL_TYPE, item_type_name(type), COL_SIZE, sz, -1);
+        return;
+    }
+    if (!remove) store_add(app->store_srv, name, item_type_name(type), sz);
+}
+
+// One entry changed: patch the cached listing of its directory and, when
+// that is the directory on screen, the rows themselves.
+static void apply_change(App *app, const char *path, char type, gint64 size, gboolean remove)
+{
+    gchar *dir;
+    const char *name;
+    split_server_path(path, &dir, &name);
+    if (*name) {
+        cache_apply(app, dir, name, type, size, remove);
+        if (g_strcmp0(app->srv_cwd, dir) == 0) store_apply(app, name, type, size, remove);
+    }
+    if (remove && type != 'f') cache_forget(app, path);
+    g_free(dir);
+}
+
+// "EVENT <kind> <type> <size> <path>", see the server's ssub. Runs on the
+// UI thread.
+static gboolean ui_apply_event(gpointer data)
+{
+    App *app = ((gpointer*)data)[0];
+    gchar *ev = ((gpointer*)data)[1];
+    char kind[16], type;
+    long long size;
+    int off = 0;
+    if (sscanf(ev, "%15s %c %lld %n", kind, &type, &size, &off) == 3 && off) {
+        char *path = ev + off;
+        if (!strcmp(kind, "overflow")) {
+            refresh_server(app, TRUE);
+        } else if (!strcmp(kind, "deleted")) {
+            apply_change(app, path, type, 0, TRUE);
+            if (g_strcmp0(app->srv_cwd, path) == 0) status_msg(app, "Server directory %s was removed", path);
+        } else if (!strcmp(kind, "renamed")) {
+            char *to = strchr(path, '\t');
+            if (to) {
+                *to++ = 0;
+                apply_change(app, path, type, 0, TRUE);
+                apply_change(app, to, type, size, FALSE);
+            }
+        } else {
+            apply_change(app, path, type, size, FALSE);
+        }
+    }
+    g_free(ev);
+    g_free(data);
+    return FALSE;
+}
+
+// Owns the receiving side of the socket: pushed events go to the UI,
+// everything else is a reply for whoever holds sock_mutex.
+static gpointer reader_thread(gpointer user)
+{
+    App *app = (App*)user;
+    char buf[8192], line[2048];
+    size_t pos = 0;
+    for (;;) {
+        int r = recv(app->sock, buf, sizeof(buf), 0);
+        if (r <= 0) break;
+        for (int i = 0; i < r; i++) {
+            char c = buf[i];
+            if (c != '\n') {
+                if (c != '\r' && pos + 1 < sizeof(line)) line[pos++] = c;
+                continue;
+            }
+            line[pos] = 0;
+            pos = 0;
+            if (strncmp(line, "EVENT ", 6) == 0) {
+                gpointer *pack = g_new(gpointer, 2);
+                pack[0] = app;
+                pack[1] = g_strdup(line + 6);
+                g_idle_add(ui_apply_event, pack);
+            } else {
+                g_async_queue_push(app->replies, g_strdup(line));
+            }
+        }
+    }
+    g_async_queue_push(app->replies, CONN_CLOSED);
+    post_status(app, "Server connection closed");
+    return NULL;
 }
 
 static void refresh_client(App *app)
@@ -228,30 +705,159 @@ static void refresh_client(App *app)
 }
 
 /* ---- Upload (PUT) ---- */
-static int put_file(sock_t s, const char *local_path, const char *remote_name)
+static gint64 file_size(FILE *fp)
+{
+#ifdef _WIN32
+    struct _stati64 st;
+    return _fstati64(_fileno(fp), &st) == 0 ? (gint64)st.st_size : -1;
+#else
+    struct stat st;
+    return fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) ? (gint64)st.st_size : -1;
+#endif
+}
+
+// Sends exactly size bytes of fp: in-kernel with sendfile as far as it
+// goes, the rest through a large buffer. Returns 1 if the file came up
+// short (it shrank, or reading failed) before size bytes went out: the
+// request cannot be completed then, only abandoned.
+static int send_body(sock_t s, FILE *fp, gint64 size)
 {
+    gint64 off = 0;
+#ifdef __linux__
+    off_t pos = 0;
+    while (pos < size) {
+        size_t want = size - pos > (1 << 30) ? (size_t)1 << 30 : (size_t)(size - pos);
+        ssize_t r = sendfile(s, fileno(fp), &pos, want);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;          // EOF, or no sendfile here: carry on below
+    }
+    off = pos;
+    if (off < size && fseeko(fp, off, SEEK_SET) != 0) return 1;
+#endif
+    if (off == size) return 0;
+    char *buf = g_malloc(UPLOAD_BUF_SIZE);
+    int rc = 0;
+    while (rc == 0 && off < size) {
+        size_t want = size - off > UPLOAD_BUF_SIZE ? UPLOAD_BUF_SIZE : (size_t)(size - off);
+        if (fread(buf, 1, want, fp) < want) { rc = 1; break; }
+        rc = send_all(s, buf, (gint64)want);
+        off += (gint64)want;
+    }
+    g_free(buf);
+    return rc;
+}
+
+// Returns 0 once the request is out (the reply is still to be read), 1
+// if the file changed while it was sent, -1 if it could not be sent.
+// After anything but 0 the connection is out of step: close it, and the
+// server throws the partial upload away.
+static int put_file(sock_t s, const char *local_path, const char *remote_name, gint64 *size)
+{
+    if (strchr(remote_name, '\n')) return -1;
     FILE *fp = fopen(local_path, "rb");
     if (!fp) return -1;
-    // protocol: PUT name\\n then raw bytes then EOF
-    if (sendf(s, SERVER_PUT_CMD " %s\\n", remote_name) != 0) { fclose(fp); return -1; }
-    char buf[4096];
-    for (;;) {
-        size_t n = fread(buf, 1, sizeof(buf), fp);
-        if (n > 0) {
-            if (send(s, buf, (int)n, 0) != (int)n) { fclose(fp); return -1; }
-        }
-        if (n < sizeof(buf)) {
-            if (ferror(fp)) { fclose(fp); return -1; }
-            break;
+    *size = file_size(fp);
+    int rc = -1;
+    if (*size >= 0 &&
+        sendf(s, SERVER_PUT_CMD "\n%s\nSIZE %" G_GINT64_FORMAT "\n", remote_name, *size) == 0)
+        rc = send_body(s, fp, *size);
+    fclose(fp);
+    return rc;
+}
+
+// One reply line straight off a connection the reader thread does not own.
+static int sock_recv_line(sock_t s, char *buf, size_t n)
+{
+    size_t u = 0;
+    while (u + 1 < n) {
+        char ch;
+        int r = (int)recv(s, &ch, 1, 0);
+        if (r < 0 && sock_err() == EINTR) continue;
+        if (r <= 0) return -1;
+        if (ch == '\n') break;
+        if (ch != '\r') buf[u++] = ch;
+    }
+    buf[u] = '\0';
+    return (int)u;
+}
+
+// A connection of its own, in the server directory dir, so a long upload
+// neither holds up browsing nor, if it has to be abandoned, takes the
+// main connection with it.
+static sock_t upload_connect(App *app, const char *dir, char *err, size_t errsz)
+{
+    sock_t s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) { snprintf(err, errsz, "socket failed"); return INVALID_SOCKET; }
+    if (connect(s, (struct sockaddr *)&app->srv_addr, sizeof(app->srv_addr)) != 0) {
+        snprintf(err, errsz, "cannot connect");
+        CLOSESOCK(s);
+        return INVALID_SOCKET;
+    }
+    if (dir && *dir && strcmp(dir, "/") != 0) {
+        char line[256] = "";
+        if (sendf(s, SERVER_CD_CMD " %s\n", dir) != 0 || sock_recv_line(s, line, sizeof(line)) < 0 ||
+            strcmp(line, "Directory changed") != 0) {
+            snprintf(err, errsz, "%s", *line ? line : "connection lost");
+            CLOSESOCK(s);
+            return INVALID_SOCKET;
         }
     }
-    send(s, "EOF", 3, 0);
-    fclose(fp);
-    return 0;
+    return s;
+}
+
+typedef struct {
+    App *app;
+    gchar *path;
+    gchar *name;
+    gchar *dir;             // server directory shown when the upload started
+    gchar *msg;
+} Upload;
+
+static gboolean ui_upload_done(gpointer data)
+{
+    Upload *up = data;
+    status_msg(up->app, "%s", up->msg);
+    gtk_widget_set_sensitive(up->app->btn_upload, TRUE);
+    g_free(up->path);
+    g_free(up->name);
+    g_free(up->dir);
+    g_free(up->msg);
+    g_free(up);
+    return FALSE;
+}
+
+static gpointer upload_thread(gpointer user)
+{
+    Upload *up = user;
+    App *app = up->app;
+    char reply[256] = "";
+    gint64 size = 0;
+
+    gint64 t0 = g_get_monotonic_time();
+    int rc = -1;
+    sock_t s = upload_connect(app, up->dir, reply, sizeof(reply));
+    if (s != INVALID_SOCKET) {
+        rc = put_file(s, up->path, up->name, &size);
+        if (rc == 0 && sock_recv_line(s, reply, sizeof(reply)) < 0) rc = -1;
+        CLOSESOCK(s);
+    }
+    gint64 t1 = g_get_monotonic_time();
+
+    double secs = (double)(t1 - t0) / 1e6, mb = (double)size / (1024.0 * 1024.0);
+    if (rc == 0 && strcmp(reply, "OK") == 0)
+        up->msg = g_strdup_printf("Uploaded %s: %.1f MB in %.2f s (%.1f MB/s)",
+                                  up->name, mb, secs, secs > 0 ? mb / secs : 0.0);
+    else if (rc == 1)
+        up->msg = g_strdup_printf("Upload of %s failed: file changed while sending", up->name);
+    else
+        up->msg = g_strdup_printf("Upload of %s failed%s%s", up->name, *reply ? ": " : "", reply);
+    g_idle_add(ui_upload_done, up);
+    refresh_server(app, FALSE);
+    return NULL;
 }
 
 /* ---- Callbacks ---- */
-static void on_srv_refresh(GtkButton *b, gpointer u){ refresh_server((App*)u); }
+static void on_srv_refresh(GtkButton *b, gpointer u){ refresh_server((App*)u, TRUE); }
 
 static void on_cli_refresh(GtkButton *b, gpointer u){ refresh_client((App*)u); }
 
@@ -260,8 +866,9 @@ static void on_srv_cd(GtkButton *b, gpointer u)
     App *app = (App*)u;
     const char *p = gtk_entry_get_text(GTK_ENTRY(app->entry_srv_path));
     if (!p || !*p) return;
-    sendf(app->sock, SERVER_CD_CMD " %s\\n", p);
-    refresh_server(app);
+    // A cached listing of the target is shown by the request thread once
+    // the server has confirmed the cd, never before.
+    server_request(app, p, FALSE);
 }
 
 static void on_cli_cd(GtkButton *b, gpointer u){ refresh_client((App*)u); }
@@ -272,14 +879,16 @@ static void on_upload(GtkButton *b, gpointer u)
     GtkWidget *dlg = gtk_file_chooser_dialog_new("Select file", GTK_WINDOW(gtk_widget_get_toplevel(b)),
         GTK_FILE_CHOOSER_ACTION_OPEN, "_Cancel", GTK_RESPONSE_CANCEL, "_Open", GTK_RESPONSE_ACCEPT, NULL);
     if (gtk_dialog_run(GTK_DIALOG(dlg)) == GTK_RESPONSE_ACCEPT) {
-        char *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dlg));
-        // derive base name
-        const char *base = g_path_get_basename(path);
-        if (put_file(app->sock, path, base) == 0) status_msg(app, "Uploaded %s", base);
-        else status_msg(app, "Upload failed");
-        g_free((gpointer)base);
-        g_free(path);
-        refresh_server(app);
+        // The transfer runs off the UI thread; the button comes back
+        // when it is done.
+        Upload *up = g_new0(Upload, 1);
+        up->app = app;
+        up->path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dlg));
+        up->name = g_path_get_basename(up->path);
+        up->dir = g_strdup(app->srv_cwd ? app->srv_cwd : "/");
+        status_msg(app, "Uploading %s...", up->name);
+        gtk_widget_set_sensitive(app->btn_upload, FALSE);
+        g_thread_unref(g_thread_new("upload", upload_thread, up));
     }
     gtk_widget_destroy(dlg);
 }
@@ -395,15 +1004,27 @@ int main(int argc, char **argv)
         perror("connect"); CLOSESOCK(s); return 1;
     }
 
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);   // sendfile to a closed connection
+#endif
     App app = {0};
     app.sock = s;
+    app.srv_addr = addr;
     getcwd(app.cwd_local, sizeof(app.cwd_local));
+    g_mutex_init(&app.sock_mutex);
+    g_mutex_init(&app.cache_mutex);
+    g_mutex_init(&app.pf_mutex);
+    g_cond_init(&app.pf_cond);
+    app.cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, listing_unref);
+    app.replies = g_async_queue_new();
+    g_thread_unref(g_thread_new("srv-reader", reader_thread, &app));
+    g_thread_unref(g_thread_new("srv-prefetch", prefetch_thread, &app));
 
     GtkWidget *win = build_ui(&app);
     gtk_widget_show_all(win);
 
     // Initial lists
-    refresh_server(&app);
+    refresh_server(&app, FALSE);
     gtk_entry_set_text(GTK_ENTRY(app.entry_cli_path), app.cwd_local);
     refresh_client(&app);
 
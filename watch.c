@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include "watch.h"
+#include "manifest.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+#define WATCH_COALESCE_MS 100       /* events are held this long to merge bursts */
+#define WATCH_MAX_PENDING 4096      /* beyond this the client just gets "overflow" */
+#define WATCH_MAX_DIRS 8192
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+                    IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+enum { WEV_CREATED, WEV_DELETED, WEV_CHANGED, WEV_RENAMED, WEV_DEAD };
+
+struct watch_ev {
+    int kind;
+    unsigned seq;
+    char *path;                     /* relative to root */
+    char *to;                       /* WEV_RENAMED: the new path */
+    int skip;                       /* merged into an earlier event */
+};
+
+struct watch_set {
+    int fd, root_wd, recursive;
+    char *root, *prefix;
+    char **dirs;                    /* wd -> directory relative to root */
+    int dircap;
+    unsigned ndirs;
+    struct watch_ev *ev;
+    size_t nev, evcap;
+    unsigned seq;
+    int overflow, root_gone;
+    long long first_ms;             /* when the oldest pending event arrived */
+    char *mv_path;                  /* IN_MOVED_FROM still waiting for its IN_MOVED_TO */
+    uint32_t mv_cookie;
+    int mv_isdir;
+    char *abs, *s1, *s2;            /* PATH_MAX scratch buffers */
+};
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char *join(const char *dir, const char *name){
+    size_t a = strlen(dir), b = strlen(name);
+    char *p = malloc(a + b + 2);
+    if (!p) return NULL;
+    if (a) { memcpy(p, dir, a); p[a++] = '/'; }
+    memcpy(p + a, name, b + 1);
+    return p;
+}
+
+static void abs_path(const struct watch_set *w, const char *rel, char *out){
+    /* out is a scratch buffer of PATH_MAX bytes */
+    snprintf(out, PATH_MAX, "%s%s%s", w->root, *rel ? "/" : "", rel);
+}
+
+static int pending(const struct watch_set *w){
+    return w->nev || w->overflow || w->root_gone || w->mv_path;
+}
+
+static void mark_first(struct watch_set *w){
+    if (!pending(w)) w->first_ms = now_ms();
+}
+
+/* Takes ownership of path and to. */
+static void add_ev(struct watch_set *w, int kind, char *path, char *to){
+    mark_first(w);
+    if (!path || (kind == WEV_RENAMED && !to) || w->overflow || w->nev >= WATCH_MAX_PENDING) {
+        w->overflow = 1;
+        free(path); free(to);
+        return;
+    }
+    if (w->nev == w->evcap) {
+        size_t ncap = w->evcap ? w->evcap * 2 : 64;
+        struct watch_ev *nv = realloc(w->ev, ncap * sizeof(*nv));
+        if (!nv) { w->overflow = 1; free(path); free(to); return; }
+        w->ev = nv;
+        w->evcap = ncap;
+    }
+    struct watch_ev *e = &w->ev[w->nev++];
+    e->kind = kind;
+    e->seq = w->seq++;
+    e->path = path;
+    e->to = to;
+    e->skip = 0;
+}
+
+static int set_dir(struct watch_set *w, int wd, const char *rel){
+    if (wd >= w->dircap) {
+        int ncap = w->dircap ? w->dircap : 64;
+        while (ncap <= wd) ncap *= 2;
+        char **nd = realloc(w->dirs, (size_t)ncap * sizeof(*nd));
+        if (!nd) return -1;
+        memset(nd + w->dircap, 0, (size_t)(ncap - w->dircap) * sizeof(*nd));
+        w->dirs = nd;
+        w->dircap = ncap;
+    }
+    char *copy = strdup(rel);
+    if (!copy) return -1;
+    if (w->dirs[wd]) free(w->dirs[wd]);
+    else w->ndirs++;
+    w->dirs[wd] = copy;
+    return 0;
+}
+
+static void drop_dir(struct watch_set *w, int wd){
+    if (wd < 0 || wd >= w->dircap || !w->dirs[wd]) return;
+    free(w->dirs[wd]);
+    w->dirs[wd] = NULL;
+    w->ndirs--;
+}
+
+/* Watches rel and, when recursive, every directory below it. With report
+   set the entries found are queued as created: they appeared before the
+   new watch could see them. Returns -1 past WATCH_MAX_DIRS. */
+static int add_tree(struct watch_set *w, const char *rel, int report){
+    char **stack = NULL;
+    size_t n = 0, cap = 0;
+    char *abs = w->abs;
+    char *top = strdup(rel);
+    int rc = 0;
+    if (!top) return -1;
+    stack = malloc(sizeof(*stack) * (cap = 16));
+    if (!stack) { free(top); return -1; }
+    stack[n++] = top;
+    while (n > 0) {
+        char *dir = stack[--n];
+        abs_path(w, dir, abs);
+        if (w->ndirs >= WATCH_MAX_DIRS) { rc = -1; free(dir); continue; }
+        int wd = inotify_add_watch(w->fd, abs, WATCH_MASK | IN_ONLYDIR);
+        if (wd < 0 || set_dir(w, wd, dir) != 0) { free(dir); continue; }
+        if (w->root_wd < 0) w->root_wd = wd;
+        DIR *d = (w->recursive || report) ? opendir(abs) : NULL;
+        struct dirent *e;
+        while (d && (e = readdir(d))) {
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            if (manifest_hidden_at(dirfd(d), e->d_name)) continue;
+            int isdir = e->d_type == DT_DIR;
+            if (e->d_type == DT_UNKNOWN) {
+                struct stat st;
+                isdir = fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (report) add_ev(w, WEV_CREATED, join(dir, e->d_name), NULL);
+            if (!isdir || !w->recursive) continue;
+            if (n == cap) {
+                char **ns = realloc(stack, sizeof(*ns) * cap * 2);
+                if (!ns) continue;
+                stack = ns;
+                cap *= 2;
+            }
+            char *child = join(dir, e->d_name);
+            if (child) stack[n++] = child;
+        }
+        if (d) closedir(d);
+        free(dir);
+    }
+    free(stack);
+    return rc;
+}
+
+/* Rewrites the directory map after a directory moved inside the tree,
+   or forgets (and unwatches) it when it left. */
+static void move_dirs(struct watch_set *w, const char *from, const char *to){
+    size_t fl = strlen(from);
+    for (int wd = 0; wd < w->dircap; wd++) {
+        char *p = w->dirs[wd];
+        if (!p || strncmp(p, from, fl) != 0 || (p[fl] != '\0' && p[fl] != '/')) continue;
+        if (!to) {
+            inotify_rm_watch(w->fd, wd);
+            drop_dir(w, wd);
+            continue;
+        }
+        char *np = p[fl] ? join(to, p + fl + 1) : strdup(to);
+        if (!np) continue;
+        free(p);
+        w->dirs[wd] = np;
+    }
+}
+
+/* Pending events below a directory that just moved are re-queued under
+   the new name, after the rename, so they still find their entry. */
+static void requeue_below(struct watch_set *w, const char *from, const char *to){
+    size_t fl = strlen(from), n = w->nev;
+    for (size_t i = 0; i < n; i++) {
+        struct watch_ev *e = &w->ev[i];
+        if (e->kind == WEV_RENAMED || e->kind == WEV_DEAD ||
+            strncmp(e->path, from, fl) != 0 || e->path[fl] != '/') continue;
+        int kind = e->kind;
+        char *np = join(to, e->path + fl + 1);
+        e->kind = WEV_DEAD;
+        add_ev(w, kind, np, NULL);
+    }
+}
+
+/* An IN_MOVED_FROM without a partner: the entry left the tree. */
+static void settle_move(struct watch_set *w){
+    if (!w->mv_path) return;
+    char *p = w->mv_path;
+    w->mv_path = NULL;
+    if (w->mv_isdir && w->recursive) move_dirs(w, p, NULL);
+    add_ev(w, WEV_DELETED, p, NULL);
+}
+
+static void handle_event(struct watch_set *w, const struct inotify_event *ev){
+    if (ev->mask & IN_Q_OVERFLOW) { mark_first(w); w->overflow = 1; return; }
+    if (ev->mask & IN_IGNORED) { drop_dir(w, ev->wd); return; }
+    if (ev->wd < 0 || ev->wd >= w->dircap || !w->dirs[ev->wd]) return;
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (ev->wd == w->root_wd) { mark_first(w); w->root_gone = 1; }
+        return;
+    }
+    if (!ev->len) return;
+    abs_path(w, w->dirs[ev->wd], w->abs);
+    if (manifest_hidden(w->abs, ev->name)) return;
+    int isdir = (ev->mask & IN_ISDIR) != 0;
+    if (w->mv_path && !((ev->mask & IN_MOVED_TO) && ev->cookie == w->mv_cookie)) settle_move(w);
+    char *rel = join(w->dirs[ev->wd], ev->name);
+    if (ev->mask & IN_MOVED_FROM) {
+        if (!rel) { add_ev(w, WEV_DELETED, NULL, NULL); return; }
+        mark_first(w);
+        w->mv_path = rel;
+        w->mv_cookie = ev->cookie;
+        w->mv_isdir = isdir;
+        return;
+    }
+    if ((ev->mask & IN_MOVED_TO) && w->mv_path) {
+        char *from = w->mv_path;
+        w->mv_path = NULL;
+        if (isdir && w->recursive && rel) move_dirs(w, from, rel);
+        char *f = from ? strdup(from) : NULL, *t = rel ? strdup(rel) : NULL;
+        add_ev(w, WEV_RENAMED, from, rel);
+        if (isdir && w->recursive && f && t) requeue_below(w, f, t);
+        free(f); free(t);
+        return;
+    }
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (isdir && w->recursive && rel && add_tree(w, rel, 1) != 0) { mark_first(w); w->overflow = 1; }
+        add_ev(w, WEV_CREATED, rel, NULL);
+    } else if (ev->mask & IN_DELETE) {
+        add_ev(w, WEV_DELETED, rel, NULL);
+    } else {
+        add_ev(w, WEV_CHANGED, rel, NULL);
+    }
+}
+
+struct watch_set *watch_open(const char *root, const char *prefix, int recursive){
+    struct watch_set *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    w->root_wd = -1;
+    w->recursive = recursive;
+    w->root = strdup(root);
+    w->prefix = strdup(prefix);
+    w->abs = malloc(PATH_MAX);
+    w->s1 = malloc(PATH_MAX);
+    w->s2 = malloc(PATH_MAX);
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (!w->root || !w->prefix || !w->abs || !w->s1 || !w->s2 || w->fd < 0 || add_tree(w, "", 0) != 0 || w->root_wd < 0) {
+        if (w->ndirs >= WATCH_MAX_DIRS) errno = ENOSPC;
+        watch_close(w);
+        return NULL;
+    }
+    return w;
+}
+
+int watch_fd(const struct watch_set *w){
+    return w->fd;
+}
+
+unsigned watch_dirs(const struct watch_set *w){
+    return w->ndirs;
+}
+
+void watch_collect(struct watch_set *w){
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(w->fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            handle_event(w, ev);
+        }
+    }
+}
+
+/* Milliseconds until watch_flush has something to send; -1 for never. */
+int watch_timeout_ms(const struct watch_set *w){
+    if (!pending(w)) return -1;
+    long long left = w->first_ms + WATCH_COALESCE_MS - now_ms();
+    return left < 0 ? 0 : (int)left;
+}
+
+static int ev_key_cmp(const void *key, const void *b){
+    return strcmp(key, (*(struct watch_ev *const *)b)->path);
+}
+
+static int ev_path_cmp(const void *a, const void *b){
+    const struct watch_ev *x = *(struct watch_ev *const *)a, *y = *(struct watch_ev *const *)b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+struct out_buf {
+    int client, failed;
+    size_t used;
+    char data[16384];
+};
+
+static void out_flush(struct out_buf *o){
+    size_t off = 0;
+    while (!o->failed && off < o->used) {
+        ssize_t r = send(o->client, o->data + off, o->used - off, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) o->failed = 1;
+        else off += (size_t)r;
+    }
+    o->used = 0;
+}
+
+static void out_line(struct out_buf *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void out_line(struct out_buf *o, const char *fmt, ...){
+    va_list ap;
+    if (sizeof(o->data) - o->used < 2 * PATH_MAX + 64) out_flush(o);
+    va_start(ap, fmt);
+    int n = vsnprintf(o->data + o->used, sizeof(o->data) - o->used, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->used += (size_t)n < sizeof(o->data) - o->used ? (size_t)n : 0;
+}
+
+static const char *shown(const struct watch_set *w, const char *rel, char *buf){
+    snprintf(buf, PATH_MAX, "%s%s%s", w->prefix, *rel || !*w->prefix ? "/" : "", rel);
+    return buf;
+}
+
+static char stat_type(const struct stat *st){
+    return S_ISDIR(st->st_mode) ? 'd' : S_ISREG(st->st_mode) ? 'f' : S_ISLNK(st->st_mode) ? 'l' : 'o';
+}
+
+/* Sends everything pending once the coalescing window has passed. Per
+   path only the net effect is reported, from the entry's state now:
+   created then deleted is dropped, changes collapse into one "changed"
+   carrying the current size. Returns -1 if the client is gone. */
+int watch_flush(struct watch_set *w, int client){
+    if (!pending(w) || now_ms() < w->first_ms + WATCH_COALESCE_MS) return 0;
+    settle_move(w);
+    struct out_buf o = { client, 0, 0, {0} };
+    struct watch_ev **byp = w->overflow ? NULL : malloc((w->nev ? w->nev : 1) * sizeof(*byp));
+    char *abs = w->abs, *s1 = w->s1, *s2 = w->s2;
+
+    if (!byp || w->root_gone) {
+        out_line(&o, "EVENT %s - 0 %s\n", w->root_gone ? "deleted" : "overflow", shown(w, "", s1));
+    } else {
+        /* Group plain events by path; the first of each group carries
+           the merged result, at the position it first happened. */
+        size_t m = 0;
+        for (size_t i = 0; i < w->nev; i++)
+            if (w->ev[i].kind != WEV_RENAMED && w->ev[i].kind != WEV_DEAD) byp[m++] = &w->ev[i];
+        qsort(byp, m, sizeof(*byp), ev_path_cmp);
+        for (size_t i = 0; i < m; ) {
+            size_t j = i + 1;
+            while (j < m && !strcmp(byp[j]->path, byp[i]->path)) byp[j++]->skip = 1;
+            i = j;
+        }
+        for (size_t i = 0; i < w->nev; i++) {
+            struct watch_ev *e = &w->ev[i];
+            struct stat st;
+            if (e->skip || e->kind == WEV_DEAD) continue;
+            if (e->kind == WEV_RENAMED) {
+                abs_path(w, e->to, abs);
+                int ok = lstat(abs, &st) == 0;
+                /* Renaming something created in this same batch: the
+                   client never saw the old name. */
+                struct watch_ev **g = bsearch(e->path, byp, m, sizeof(*byp), ev_key_cmp);
+                while (g && g > byp && !strcmp(g[-1]->path, e->path)) g--;
+                if (g && (*g)->kind == WEV_CREATED && (*g)->seq < e->seq) {
+                    if (ok) out_line(&o, "EVENT created %c %lld %s\n", stat_type(&st),
+                                     (long long)st.st_size, shown(w, e->to, s1));
+                    continue;
+                }
+                out_line(&o, "EVENT renamed %c %lld %s\t%s\n", ok ? stat_type(&st) : '-',
+                         ok ? (long long)st.st_size : 0LL, shown(w, e->path, s1), shown(w, e->to, s2));
+                continue;
+            }
+            abs_path(w, e->path, abs);
+            if (lstat(abs, &st) == 0)
+                out_line(&o, "EVENT %s %c %lld %s\n", e->kind == WEV_CREATED ? "created" : "changed",
+                         stat_type(&st), (long long)st.st_size, shown(w, e->path, s1));
+            else if (e->kind != WEV_CREATED)
+                out_line(&o, "EVENT deleted - 0 %s\n", shown(w, e->path, s1));
+        }
+    }
+    out_flush(&o);
+    free(byp);
+    for (size_t i = 0; i < w->nev; i++) { free(w->ev[i].path); free(w->ev[i].to); }
+    w->nev = 0;
+    w->overflow = 0;
+    w->root_gone = 0;
+    return o.failed ? -1 : 0;
+}
+
+void watch_close(struct watch_set *w){
+    if (!w) return;
+    if (w->fd >= 0) close(w->fd);
+    for (int i = 0; i < w->dircap; i++) free(w->dirs[i]);
+    for (size_t i = 0; i < w->nev; i++) { free(w->ev[i].path); free(w->ev[i].to); }
+    free(w->dirs);
+    free(w->ev);
+    free(w->mv_path);
+    free(w->root);
+    free(w->prefix);
+    free(w->abs); free(w->s1); free(w->s2);
+    free(w);
+}
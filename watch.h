@@ -0,0 +1,23 @@
+#ifndef WATCH_H
+#define WATCH_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* inotify subscription on one directory, or a whole subtree, feeding
+   coalesced "EVENT <kind> <type> <size> <path>" lines to a client.
+   kind is created, deleted, changed, renamed (path is "<old>\t<new>")
+   or overflow (too much happened: re-list). Paths are shown as prefix
+   followed by the path below root. */
+struct watch_set;
+
+struct watch_set *watch_open(const char *root, const char *prefix, int recursive);
+int  watch_fd(const struct watch_set *w);
+void watch_collect(struct watch_set *w);
+int  watch_timeout_ms(const struct watch_set *w);
+int  watch_flush(struct watch_set *w, int client);
+unsigned watch_dirs(const struct watch_set *w);
+void watch_close(struct watch_set *w);
+#ifdef __cplusplus
+}
+#endif
+#endif